@@ -0,0 +1,117 @@
+/******************************************************************************
+*                           Row Scan Benchmark                                *
+******************************************************************************/
+
+/**
+ * Compares whole document scans over the old array of row
+ * structures with the editor's own table of parallel row
+ * arrays. Both layouts run the same loops, hence only the
+ * layout differs.
+ *
+ * gcc -O2 -fcommon -pthread -o bench_scan bench_scan.c spell.c dictionary.c
+ *   pool.c journal.c trace.c changelog.c diff.c recover.c dictserver.c
+ *   -std=gnu99
+ * ./bench_scan [rows]
+ */
+
+/** The editor is built in, its table is the one measured **/
+#define main editorMain
+#include "editor.c"
+#undef main
+
+#define ROWS 10000000
+#define LOOKUPS 100
+
+/** The old row structure, one per row **/
+typedef struct oldRow {
+  int size;
+  char *chars;
+  int rsize;
+  char *render;
+  unsigned char *hl;
+} oldRow;
+
+/** Monotonic time in seconds **/
+static double benchTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Line lengths of a plausible source file **/
+static int lineLength(int i) {
+  return (int) ((i * 7919LL) % 97);
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : ROWS;
+  long long sum = 0, total = 0, check = 0;
+  double t, aos[3], soa[3];
+
+  long long *targets = malloc(sizeof(long long) * LOOKUPS);
+  long long *offsets = malloc(sizeof(long long) * (n + 1));
+
+  /** Array of structures **/
+  oldRow *rows = calloc(n, sizeof(oldRow));
+  for (int i = 0; i < n; i++) rows[i].size = rows[i].rsize = lineLength(i);
+
+  t = benchTime();
+  for (int i = 0; i < n; i++) sum += rows[i].size + 1;
+  aos[0] = benchTime() - t;
+  for (int i = 0; i < LOOKUPS; i++) targets[i] = sum / LOOKUPS * i;
+
+  t = benchTime();
+  offsets[0] = 0;
+  for (int i = 0; i < n; i++) offsets[i + 1] = offsets[i] + rows[i].size + 1;
+  aos[1] = benchTime() - t;
+
+  /** Every lookup walks the rows up to the offset **/
+  t = benchTime();
+  for (int k = 0; k < LOOKUPS; k++) {
+    long long off = 0;
+    int i = 0;
+    while (i < n && off + rows[i].size + 1 <= targets[k]) off += rows[i++].size + 1;
+    check += i;
+  }
+  aos[2] = benchTime() - t;
+  free(rows);
+
+  /** The editor's row table **/
+  growRows(n);
+  E.numrows = n;
+  for (int i = 0; i < n; i++) E.row.size[i] = E.row.rsize[i] = lineLength(i);
+
+  t = benchTime();
+  for (int i = 0; i < E.numrows; i++) total += E.row.size[i] + 1;
+  soa[0] = benchTime() - t;
+
+  t = benchTime();
+  offsets[0] = 0;
+  for (int i = 0; i < E.numrows; i++) offsets[i + 1] = offsets[i] + E.row.size[i] + 1;
+  soa[1] = benchTime() - t;
+
+  t = benchTime();
+  for (int k = 0; k < LOOKUPS; k++) {
+    long long off = 0;
+    int i = 0;
+    while (i < n && off + E.row.size[i] + 1 <= targets[k]) off += E.row.size[i++] + 1;
+    check -= i;
+  }
+  soa[2] = benchTime() - t;
+
+  if (total != sum || check != 0) {
+    printf("Results differ.\n");
+    return 1;
+  }
+
+  printf("%d rows, %lld bytes\n", n, total);
+  printf("%-24s %12s %12s %9s\n", "scan", "structs", "arrays", "speedup");
+  const char *names[] = {"length sum", "prefix sums", "offset walks x100"};
+  for (int i = 0; i < 3; i++)
+    printf("%-24s %10.2fms %10.2fms %8.1fx\n", names[i], aos[i] * 1e3,
+      soa[i] * 1e3, soa[i] > 0 ? aos[i] / soa[i] : 0.0);
+
+  free(offsets);
+  free(targets);
+  return 0;
+}
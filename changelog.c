@@ -0,0 +1,682 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "changelog.h"
+#include "diff.h"
+
+/**
+ * The log is a header, then one record per revision, then the
+ * index and a footer:
+ *
+ *   "EDLOG1\n"
+ *   record:  type u8, time i64, lines u32, rawlen u32, complen u32, data
+ *   index:   n * struct revision
+ *   footer:  n u32, index offset i64, "EDINDEX\n"
+ *
+ * Saving drops the index, appends a record and writes the index
+ * again. If the footer is lost the index is rebuilt from the records.
+ */
+#define LOG_MAGIC "EDLOG1\n"
+#define LOG_MAGIC_LEN 7
+#define INDEX_MAGIC "EDINDEX\n"
+#define INDEX_MAGIC_LEN 8
+#define RECORD_HEADER 21
+#define FOOTER_SIZE (4 + 8 + INDEX_MAGIC_LEN)
+
+/******************************************************************************
+*                              Compression                                    *
+******************************************************************************/
+
+/**
+ * A small LZ77 coder in the style of LZ4. Every sequence is a
+ * token, literals and a match: the token holds the number of
+ * literals in its high nibble and the match length - 4 in its
+ * low nibble, 15 meaning more length bytes follow. The match is
+ * a 2 byte offset back into the output. The last sequence has
+ * literals only.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+/** Upper bound of the compressed size of n bytes **/
+static size_t lzBound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+/** Writes an extended length **/
+static unsigned char *lzLength(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/**
+ * Compresses n bytes of src into dst, which holds lzBound(n).
+ * @return the compressed size.
+ */
+static size_t lzCompress(const unsigned char *src, size_t n, unsigned char *dst)
+{
+    static uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    unsigned char *op = dst;
+    size_t ip = 0, anchor = 0;
+
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET
+            || memcmp(src + ref - 1, src + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        size_t m = ref - 1;
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < n && src[m + len] == src[ip + len])
+            len++;
+
+        /** Token, literals, offset and match length **/
+        size_t lit = ip - anchor;
+        size_t ml = len - LZ_MIN_MATCH;
+        *op++ = (lit < 15 ? lit : 15) << 4 | (ml < 15 ? ml : 15);
+        if (lit >= 15)
+            op = lzLength(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (ip - m) & 0xff;
+        *op++ = (ip - m) >> 8;
+        if (ml >= 15)
+            op = lzLength(op, ml - 15);
+
+        ip += len;
+        anchor = ip;
+    }
+
+    /** The last literals **/
+    size_t lit = n - anchor;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = lzLength(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/** Reads an extended length, -1 past the end of the input **/
+static long lzReadLength(const unsigned char **ip, const unsigned char *end)
+{
+    long len = 0;
+    unsigned char b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/**
+ * Decompresses n bytes of src into dst, which holds cap bytes.
+ * @return the decompressed size, -1 if the input is corrupt.
+ */
+static long lzDecompress(const unsigned char *src, size_t n,
+    unsigned char *dst, size_t cap)
+{
+    const unsigned char *ip = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+        long lit = token >> 4;
+        if (lit == 15) {
+            long more = lzReadLength(&ip, end);
+            if (more < 0)
+                return -1;
+            lit += more;
+        }
+        if (lit > end - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        long ml = token & 15;
+        if (ml == 15) {
+            long more = lzReadLength(&ip, end);
+            if (more < 0)
+                return -1;
+            ml += more;
+        }
+        ml += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t) (op - dst) || ml > oend - op)
+            return -1;
+        /** Byte by byte, the match may overlap itself **/
+        unsigned char *m = op - off;
+        for (long i = 0; i < ml; i++)
+            op[i] = m[i];
+        op += ml;
+    }
+    return op - dst;
+}
+
+
+/******************************************************************************
+*                                 Records                                     *
+******************************************************************************/
+
+/**
+ * Writes all len bytes of buf at an offset.
+ * @return 0 if successful, -1 on error.
+ */
+static int writeAt(int fd, const void *buf, size_t len, long long off)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Reads all len bytes at an offset into buf.
+ * @return 0 if successful, -1 on error or end of file.
+ */
+static int readAt(int fd, void *buf, size_t len, long long off)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/** The fixed size part of a record **/
+typedef struct recordHeader {
+    int type;
+    long long time;
+    uint32_t lines, rawlen, complen;
+} recordHeader;
+
+static void packHeader(unsigned char *b, const recordHeader *h)
+{
+    b[0] = h->type;
+    memcpy(b + 1, &h->time, 8);
+    memcpy(b + 9, &h->lines, 4);
+    memcpy(b + 13, &h->rawlen, 4);
+    memcpy(b + 17, &h->complen, 4);
+}
+
+static int readHeader(int fd, long long off, recordHeader *h)
+{
+    unsigned char b[RECORD_HEADER];
+    if (readAt(fd, b, RECORD_HEADER, off) == -1)
+        return -1;
+    h->type = b[0];
+    memcpy(&h->time, b + 1, 8);
+    memcpy(&h->lines, b + 9, 4);
+    memcpy(&h->rawlen, b + 13, 4);
+    memcpy(&h->complen, b + 17, 4);
+    if (h->type != REC_CHECKPOINT && h->type != REC_DELTA)
+        return -1;
+    return 0;
+}
+
+/** Adds a revision to the in memory index **/
+static int addRevision(struct changeLog *log, long long off,
+    const recordHeader *h)
+{
+    struct revision *r = realloc(log->rev, sizeof(*r) * (log->n + 1));
+    if (r == NULL)
+        return -1;
+    log->rev = r;
+    r[log->n].offset = off;
+    r[log->n].time = h->time;
+    r[log->n].type = h->type;
+    r[log->n].lines = h->lines;
+    log->n++;
+    return 0;
+}
+
+/**
+ * Rebuilds the index by walking the records, for logs whose
+ * index was not written. A torn record at the end is dropped.
+ */
+static void scanRecords(struct changeLog *log, long long size)
+{
+    long long off = LOG_MAGIC_LEN;
+    recordHeader h;
+    while (off + RECORD_HEADER <= size && readHeader(log->fd, off, &h) == 0
+        && off + RECORD_HEADER + h.complen <= size) {
+        if (addRevision(log, off, &h) == -1)
+            break;
+        off += RECORD_HEADER + h.complen;
+    }
+    log->end = off;
+}
+
+/**
+ * Reads the index through the footer.
+ * @return 0 if successful, -1 if there is no valid footer.
+ */
+static int readIndex(struct changeLog *log, long long size)
+{
+    unsigned char f[FOOTER_SIZE];
+    if (size < LOG_MAGIC_LEN + FOOTER_SIZE
+        || readAt(log->fd, f, FOOTER_SIZE, size - FOOTER_SIZE) == -1
+        || memcmp(f + 12, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0)
+        return -1;
+
+    uint32_t n;
+    long long at;
+    memcpy(&n, f, 4);
+    memcpy(&at, f + 4, 8);
+    if (at < LOG_MAGIC_LEN || at + (long long) sizeof(struct revision) * n
+        + FOOTER_SIZE != size)
+        return -1;
+
+    log->rev = malloc(sizeof(struct revision) * (n ? n : 1));
+    if (log->rev == NULL
+        || readAt(log->fd, log->rev, sizeof(struct revision) * n, at) == -1) {
+        free(log->rev);
+        log->rev = NULL;
+        return -1;
+    }
+    log->n = n;
+    log->end = at;
+    return 0;
+}
+
+/**
+ * Writes the index and the footer after the last record.
+ * @return 0 if successful, -1 on error.
+ */
+static int writeIndex(struct changeLog *log)
+{
+    unsigned char f[FOOTER_SIZE];
+    uint32_t n = log->n;
+    memcpy(f, &n, 4);
+    memcpy(f + 4, &log->end, 8);
+    memcpy(f + 12, INDEX_MAGIC, INDEX_MAGIC_LEN);
+
+    size_t len = sizeof(struct revision) * log->n;
+    if (writeAt(log->fd, log->rev, len, log->end) == -1
+        || writeAt(log->fd, f, FOOTER_SIZE, log->end + len) == -1
+        || ftruncate(log->fd, log->end + len + FOOTER_SIZE) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Opens the log, reading only its index.
+ * @param path is the log file.
+ * @param write is true to create it if needed and append to it.
+ * @return 0 if successful, -1 otherwise.
+ */
+int logOpen(struct changeLog *log, const char *path, bool write)
+{
+    memset(log, 0, sizeof(*log));
+    log->fd = open(path, write ? O_RDWR | O_CREAT | O_CLOEXEC
+        : O_RDONLY | O_CLOEXEC, 0644);
+    if (log->fd == -1)
+        return -1;
+
+    long long size = lseek(log->fd, 0, SEEK_END);
+    char magic[LOG_MAGIC_LEN];
+    if (size > 0 && (size < LOG_MAGIC_LEN
+        || readAt(log->fd, magic, LOG_MAGIC_LEN, 0) == -1
+        || memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) != 0)) {
+        /** A log of full snapshots, keep it under another name **/
+        close(log->fd);
+        if (!write)
+            return -1;
+        char *old = malloc(strlen(path) + 5);
+        if (old == NULL)
+            return -1;
+        sprintf(old, "%s.old", path);
+        int err = rename(path, old);
+        free(old);
+        if (err == -1)
+            return -1;
+        return logOpen(log, path, write);
+    }
+
+    if (size == 0) {
+        if (!write || writeAt(log->fd, LOG_MAGIC, LOG_MAGIC_LEN, 0) == -1) {
+            close(log->fd);
+            return -1;
+        }
+        log->end = LOG_MAGIC_LEN;
+        return 0;
+    }
+
+    if (readIndex(log, size) == -1)
+        scanRecords(log, size);
+    return 0;
+}
+
+void logClose(struct changeLog *log)
+{
+    if (log->fd != -1)
+        close(log->fd);
+    free(log->rev);
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+}
+
+
+/******************************************************************************
+*                                Revisions                                    *
+******************************************************************************/
+
+/**
+ * Reads and decompresses the payload of a record.
+ * @return the payload, NULL on error. Sets h.
+ */
+static unsigned char *readRecord(struct changeLog *log, int i, recordHeader *h)
+{
+    if (readHeader(log->fd, log->rev[i].offset, h) == -1)
+        return NULL;
+    unsigned char *comp = malloc(h->complen ? h->complen : 1);
+    unsigned char *raw = malloc(h->rawlen ? h->rawlen : 1);
+    if (comp == NULL || raw == NULL
+        || readAt(log->fd, comp, h->complen,
+            log->rev[i].offset + RECORD_HEADER) == -1
+        || lzDecompress(comp, h->complen, raw, h->rawlen) != h->rawlen) {
+        free(comp);
+        free(raw);
+        return NULL;
+    }
+    free(comp);
+    return raw;
+}
+
+/**
+ * Finds where every line of a text starts.
+ * @return the offsets, with one more for the end. NULL on error.
+ */
+static size_t *lineStarts(const char *text, size_t len, int lines)
+{
+    size_t *start = malloc(sizeof(size_t) * (lines + 1));
+    if (start == NULL)
+        return NULL;
+    const char *p = text, *end = text + len;
+    for (int i = 0; i < lines; i++) {
+        start[i] = p - text;
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+    start[lines] = p - text;
+    return start;
+}
+
+/**
+ * A delta is a list of hunks, in order, each made of the number
+ * of lines of the previous revision kept since the last hunk,
+ * the number of its lines deleted and the lines inserted:
+ * prefix u32, deleted u32, inserted u32, inserted text. The
+ * lines after the last hunk are kept.
+ * @param text is the previous revision, lines its line count.
+ * @return the new revision, NULL on error. Sets len.
+ */
+static char *applyDelta(char *text, size_t len, int lines,
+    const unsigned char *d, size_t dlen, size_t *newlen)
+{
+    size_t *start = lineStarts(text, len, lines);
+    char *out = malloc(len + dlen + 1);
+    if (start == NULL || out == NULL) {
+        free(start);
+        free(out);
+        return NULL;
+    }
+
+    const unsigned char *p = d, *end = d + dlen;
+    size_t o = 0;
+    long long at = 0;
+    while (p < end) {
+        uint32_t prefix, deleted, inserted;
+        if (end - p < 12)
+            goto corrupt;
+        memcpy(&prefix, p, 4);
+        memcpy(&deleted, p + 4, 4);
+        memcpy(&inserted, p + 8, 4);
+        p += 12;
+        if (at + prefix + deleted > lines)
+            goto corrupt;
+
+        /** The kept lines, then the inserted ones **/
+        size_t kept = start[at + prefix] - start[at];
+        memcpy(out + o, text + start[at], kept);
+        o += kept;
+        at += prefix + deleted;
+        const unsigned char *q = p;
+        for (uint32_t i = 0; i < inserted; i++) {
+            const unsigned char *nl = memchr(q, '\n', end - q);
+            if (nl == NULL)
+                goto corrupt;
+            q = nl + 1;
+        }
+        memcpy(out + o, p, q - p);
+        o += q - p;
+        p = q;
+    }
+    memcpy(out + o, text + start[at], len - start[at]);
+    *newlen = o + len - start[at];
+    free(start);
+    return out;
+
+corrupt:
+    free(start);
+    free(out);
+    return NULL;
+}
+
+/**
+ * Materializes a revision from the last checkpoint before it
+ * and at most LOG_CHECKPOINT - 1 deltas.
+ * @param i is the revision.
+ * @param len is set to the length of the text.
+ * @return the text, NULL on error.
+ */
+char *logRevision(struct changeLog *log, int i, size_t *len)
+{
+    if (i < 0 || i >= log->n)
+        return NULL;
+    int c = i;
+    while (c > 0 && log->rev[c].type != REC_CHECKPOINT)
+        c--;
+
+    recordHeader h;
+    char *text = (char *) readRecord(log, c, &h);
+    if (text == NULL || h.type != REC_CHECKPOINT) {
+        free(text);
+        return NULL;
+    }
+    *len = h.rawlen;
+    int lines = h.lines;
+
+    for (int r = c + 1; r <= i && text; r++) {
+        unsigned char *d = readRecord(log, r, &h);
+        char *next = d ? applyDelta(text, *len, lines, d, h.rawlen, len) : NULL;
+        free(d);
+        free(text);
+        text = next;
+        lines = h.lines;
+    }
+    return text;
+}
+
+/**
+ * Compresses a payload and appends it as a record, then
+ * writes the index again.
+ * @return 0 if successful, -1 on error.
+ */
+static int appendRecord(struct changeLog *log, int type, long long time,
+    int lines, const unsigned char *raw, size_t rawlen)
+{
+    unsigned char *comp = malloc(lzBound(rawlen) + RECORD_HEADER);
+    if (comp == NULL)
+        return -1;
+    size_t complen = lzCompress(raw, rawlen, comp + RECORD_HEADER);
+    recordHeader h = {type, time, lines, rawlen, complen};
+    packHeader(comp, &h);
+
+    long long off = log->end;
+    int err = writeAt(log->fd, comp, RECORD_HEADER + complen, off);
+    free(comp);
+    if (err == -1 || addRevision(log, off, &h) == -1)
+        return -1;
+    log->end = off + RECORD_HEADER + complen;
+    return writeIndex(log);
+}
+
+/**
+ * Appends a revision. Every LOG_CHECKPOINT-th revision is the
+ * full text, the others are the hunks of a line diff against
+ * the previous revision.
+ * @param lines is the text of each line, size their sizes.
+ * @param n is the number of lines.
+ * @param time is the time of the save.
+ * @return 0 if successful, -1 on error.
+ */
+int logAppend(struct changeLog *log, char **lines, const int *size, int n,
+    long long time)
+{
+    char *prev = NULL;
+    size_t prevlen = 0;
+    int prevlines = 0;
+    if (log->n % LOG_CHECKPOINT != 0) {
+        prev = logRevision(log, log->n - 1, &prevlen);
+        prevlines = log->rev[log->n - 1].lines;
+    }
+
+    /** Diff the lines of both revisions **/
+    struct diffOp *ops = NULL;
+    int nops = 0;
+    if (prev) {
+        size_t *start = lineStarts(prev, prevlen, prevlines);
+        char **pline = malloc(sizeof(char *) * (prevlines + 1));
+        int *plen = malloc(sizeof(int) * (prevlines + 1));
+        unsigned long long *phash = malloc(sizeof(*phash) * (prevlines + 1));
+        unsigned long long *hash = malloc(sizeof(*hash) * (n + 1));
+        nops = -1;
+        if (start && pline && plen && phash && hash) {
+            for (int i = 0; i < prevlines; i++) {
+                pline[i] = prev + start[i];
+                plen[i] = start[i + 1] - start[i] - 1;
+                phash[i] = lineHash(pline[i], plen[i]);
+            }
+            for (int i = 0; i < n; i++)
+                hash[i] = lineHash(lines[i], size[i]);
+            struct diffText a = {phash, pline, plen, prevlines};
+            struct diffText b = {hash, lines, size, n};
+            nops = diffLines(&a, &b, &ops);
+        }
+        free(start);
+        free(pline);
+        free(plen);
+        free(phash);
+        free(hash);
+        if (nops == -1) {
+            free(prev);
+            return -1;
+        }
+    }
+
+    /** Gather the payload: the whole text or the hunks **/
+    size_t rawlen = 0;
+    if (prev) {
+        for (int i = 0; i < nops; i++) {
+            if (ops[i].type == DIFF_INSERT)
+                for (int k = ops[i].b; k < ops[i].b + ops[i].n; k++)
+                    rawlen += size[k] + 1;
+            if (ops[i].type != DIFF_EQUAL
+                && (i == 0 || ops[i - 1].type == DIFF_EQUAL))
+                rawlen += 12;
+        }
+    } else {
+        for (int i = 0; i < n; i++)
+            rawlen += size[i] + 1;
+    }
+    unsigned char *raw = malloc(rawlen ? rawlen : 1);
+    if (raw == NULL) {
+        free(prev);
+        free(ops);
+        return -1;
+    }
+
+    unsigned char *p = raw;
+    if (prev) {
+        /** The runs between two equal ones make a hunk **/
+        uint32_t kept = 0;
+        for (int i = 0; i < nops; i++) {
+            if (ops[i].type == DIFF_EQUAL) {
+                kept += ops[i].n;
+                continue;
+            }
+            uint32_t v[3] = {kept, 0, 0};
+            int from = ops[i].b;
+            for (; i < nops && ops[i].type != DIFF_EQUAL; i++)
+                v[ops[i].type == DIFF_DELETE ? 1 : 2] += ops[i].n;
+            i--;
+            memcpy(p, v, 12);
+            p += 12;
+            for (int k = from; k < from + (int) v[2]; k++) {
+                memcpy(p, lines[k], size[k]);
+                p += size[k];
+                *p++ = '\n';
+            }
+            kept = 0;
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            memcpy(p, lines[i], size[i]);
+            p += size[i];
+            *p++ = '\n';
+        }
+    }
+
+    int err = appendRecord(log, prev ? REC_DELTA : REC_CHECKPOINT, time, n,
+        raw, rawlen);
+    free(raw);
+    free(prev);
+    free(ops);
+    return err;
+}
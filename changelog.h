@@ -0,0 +1,50 @@
+#ifndef CHANGELOG_H
+#define CHANGELOG_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Every LOG_CHECKPOINT revisions the full text is logged,
+ * the ones in between are deltas against the previous one. **/
+#define LOG_CHECKPOINT 16
+
+/** Types of log records **/
+enum recordType {
+    REC_CHECKPOINT = 1,     /* the compressed text of the revision */
+    REC_DELTA               /* the compressed line diff to the previous */
+};
+
+/** An entry of the trailing index, one per revision **/
+struct revision {
+    long long offset;       /* Offset of the record in the log */
+    long long time;         /* Time of the save */
+    int type;               /* recordType */
+    int lines;              /* Number of lines of the revision */
+};
+
+/** An open change log. The index is read on open, records
+ * are only read when a revision is materialized. **/
+struct changeLog {
+    int fd;
+    struct revision *rev;   /* The index */
+    int n;                  /* Number of revisions */
+    long long end;          /* Offset the index is written at */
+};
+
+/** Opens the log of a file, creating it if write is true. A log
+ * in the old format is moved aside to path.old. Returns 0 if
+ * successful, -1 otherwise. **/
+int logOpen(struct changeLog *log, const char *path, bool write);
+
+/** Appends a revision made of n lines, each without its newline.
+ * Returns 0 if successful, -1 otherwise. **/
+int logAppend(struct changeLog *log, char **lines, const int *size, int n,
+    long long time);
+
+/** Returns the text of revision i, lines ending with newlines,
+ * and sets len to its length. The caller frees it. NULL on error. **/
+char *logRevision(struct changeLog *log, int i, size_t *len);
+
+/** Closes the log **/
+void logClose(struct changeLog *log);
+
+#endif
@@ -152,3 +152,81 @@ bool unload()
     free(nodeBucket);
     return true;
 }
+
+
+/**
+ * Given a word, finds the words of the dictionary one edit
+ * away from it: a letter deleted, swapped with the next one,
+ * replaced or inserted.
+ * @param word is the misspelled word
+ * @param out is filled in with the suggestions, in lower case
+ * @param max is the most suggestions wanted
+ * @return the number of suggestions
+ */
+int suggest(const char* word, char out[][LENGTH + 1], int max)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz'";
+    char w[LENGTH + 1], c[LENGTH + 2];
+    int len = 0, n = 0;
+
+    /** Compare in lower case, as check does **/
+    for (; word[len] != '\0' && len < LENGTH; len++)
+        w[len] = tolower((unsigned char) word[len]);
+    w[len] = '\0';
+
+    /** Every candidate is tried in turn, each one is a check **/
+    for (int edit = 0; edit < 4 && n < max; edit++)
+    {
+        int positions = edit == 3 ? len + 1 : len;
+        for (int i = 0; i < positions && n < max; i++)
+        {
+            int tries = (edit == 0 || edit == 1) ? 1 : ALPHA;
+            for (int k = 0; k < tries && n < max; k++)
+            {
+                int clen = len;
+                memcpy(c, w, len + 1);
+                if (edit == 0)
+                {
+                    /** Deletion **/
+                    memmove(&c[i], &c[i + 1], len - i);
+                    clen--;
+                }
+                else if (edit == 1)
+                {
+                    /** Transposition **/
+                    if (i + 1 >= len || c[i] == c[i + 1])
+                        continue;
+                    char t = c[i];
+                    c[i] = c[i + 1];
+                    c[i + 1] = t;
+                }
+                else if (edit == 2)
+                {
+                    /** Substitution **/
+                    if (c[i] == letters[k])
+                        continue;
+                    c[i] = letters[k];
+                }
+                else
+                {
+                    /** Insertion **/
+                    if (len == LENGTH)
+                        continue;
+                    memmove(&c[i + 1], &c[i], len - i + 1);
+                    c[i] = letters[k];
+                    clen++;
+                }
+                if (clen == 0 || c[0] == '\'' || !check(c))
+                    continue;
+
+                /** Skip the ones found already **/
+                bool seen = false;
+                for (int j = 0; j < n && !seen; j++)
+                    seen = strcmp(out[j], c) == 0;
+                if (!seen)
+                    strcpy(out[n++], c);
+            }
+        }
+    }
+    return n;
+}
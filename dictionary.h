@@ -5,6 +5,9 @@
 /** maximum length for a word **/
 #define LENGTH 45
 
+/** The words the spelling checker knows **/
+#define DICTIONARY "large.txt"
+
 /** Returns true if word is in dictionary 
  * else false. **/
 bool check(const char* word);
@@ -13,6 +16,10 @@ bool check(const char* word);
  * true if successful else false. **/
 bool load(const char* dictionary);
 
+/** Fills out with up to max words one edit away from
+ * word. Returns their number. **/
+int suggest(const char* word, char out[][LENGTH + 1], int max);
+
 /** Unloads dictionary from memory. 
  * Returns true if successful else false. **/
 bool unload();
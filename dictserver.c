@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "dictserver.h"
+
+/** The socket the server listens on, removed when it ends **/
+static const char *socketPath;
+
+/** Connections being served **/
+static int clients;
+static pthread_mutex_t clientsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Reads exactly len bytes.
+ * @return 0 if successful, -1 on error or end of file.
+ */
+static int readFull(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Sends all len bytes of buf. A server that went away is an
+ * error, not a SIGPIPE.
+ * @return 0 if successful, -1 on error.
+ */
+static int writeFull(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void packHeader(char *b, uint32_t op, uint32_t count, uint32_t size)
+{
+    memcpy(b, &op, 4);
+    memcpy(b + 4, &count, 4);
+    memcpy(b + 8, &size, 4);
+}
+
+/**
+ * Splits the words of a request into NUL terminated strings.
+ * @return the number of words, -1 if the request is malformed.
+ */
+static int unpackWords(const char *buf, uint32_t size, uint32_t count,
+    char words[][LENGTH + 1])
+{
+    const char *p = buf, *end = buf + size;
+    for (uint32_t i = 0; i < count; i++) {
+        if (p == end || (unsigned char) *p > LENGTH || end - p - 1 < *p)
+            return -1;
+        int len = (unsigned char) *p++;
+        memcpy(words[i], p, len);
+        words[i][len] = '\0';
+        p += len;
+    }
+    return p == end ? (int) count : -1;
+}
+
+/**
+ * Answers the requests of one editor until it disconnects.
+ * The trie is only read, every connection has a thread.
+ */
+static void *serveClient(void *arg)
+{
+    int fd = (int) (intptr_t) arg;
+    char (*words)[LENGTH + 1] = malloc(sizeof(*words) * DICT_BATCH);
+    char *buf = malloc(DICT_BATCH * (LENGTH + 1));
+    unsigned char *known = malloc(DICT_BATCH / 8);
+    char reply[4 + DICT_SUGGESTIONS * (LENGTH + 1)];
+
+    while (words && buf && known) {
+        char header[DICT_HEADER];
+        uint32_t op, count, size;
+        if (readFull(fd, header, DICT_HEADER) == -1)
+            break;
+        memcpy(&op, header, 4);
+        memcpy(&count, header + 4, 4);
+        memcpy(&size, header + 8, 4);
+        if (count > DICT_BATCH || size > DICT_BATCH * (LENGTH + 1)
+            || readFull(fd, buf, size) == -1
+            || unpackWords(buf, size, count, words) == -1)
+            break;
+
+        if (op == DICT_CHECK) {
+            memset(known, 0, (count + 7) / 8);
+            for (uint32_t i = 0; i < count; i++)
+                if (words[i][0] != '\0' && check(words[i]))
+                    known[i / 8] |= 1 << (i % 8);
+            if (writeFull(fd, known, (count + 7) / 8) == -1)
+                break;
+        } else if (op == DICT_SUGGEST && count == 1) {
+            char out[DICT_SUGGESTIONS][LENGTH + 1];
+            uint32_t n = suggest(words[0], out, DICT_SUGGESTIONS);
+            int len = 4;
+            memcpy(reply, &n, 4);
+            for (uint32_t i = 0; i < n; i++) {
+                int wlen = strlen(out[i]);
+                reply[len++] = wlen;
+                memcpy(reply + len, out[i], wlen);
+                len += wlen;
+            }
+            if (writeFull(fd, reply, len) == -1)
+                break;
+        } else {
+            break;
+        }
+    }
+    free(words);
+    free(buf);
+    free(known);
+    close(fd);
+    pthread_mutex_lock(&clientsLock);
+    clients--;
+    pthread_mutex_unlock(&clientsLock);
+    return NULL;
+}
+
+/**
+ * Takes a connection if it comes from the user running the
+ * server and there is room for it.
+ * @return true if it is to be served.
+ */
+static bool admitClient(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1
+        || cred.uid != getuid())
+        return false;
+    pthread_mutex_lock(&clientsLock);
+    bool room = clients < DICT_MAX_CLIENTS;
+    if (room)
+        clients++;
+    pthread_mutex_unlock(&clientsLock);
+    return room;
+}
+
+const char *dictDefaultSocket(void)
+{
+    static char path[64];
+    snprintf(path, sizeof(path), DICT_SOCKET, (unsigned) getuid());
+    return path;
+}
+
+static void stopServer(int sig)
+{
+    unlink(socketPath);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * A socket left by a server that died is replaced, one that
+ * a server answers on is not. The socket is only open to the
+ * user running the server.
+ */
+int dictServe(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int probe = dictConnect(path);
+    if (probe != -1) {
+        close(probe);
+        fprintf(stderr, "A dictionary server is running on %s\n", path);
+        return 1;
+    }
+    if (!load(DICTIONARY)) {
+        fprintf(stderr, "Could not load %s.\n", DICTIONARY);
+        return 1;
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    /** Created 0600, there is no moment it is open to others **/
+    mode_t mask = umask(0177);
+    int err = lfd == -1 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(lfd, 64) == -1;
+    umask(mask);
+    if (err) {
+        perror(path);
+        return 1;
+    }
+    socketPath = path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGHUP, stopServer);
+    printf("Serving %s on %s\n", DICTIONARY, path);
+    fflush(stdout);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+    while (1) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE)
+                continue;
+            perror("accept");
+            break;
+        }
+        /** Refused editors see the connection close and check
+         * on their own **/
+        if (!admitClient(fd)) {
+            close(fd);
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serveClient, (void *) (intptr_t) fd) != 0) {
+            close(fd);
+            pthread_mutex_lock(&clientsLock);
+            clients--;
+            pthread_mutex_unlock(&clientsLock);
+        }
+    }
+    unlink(path);
+    return 1;
+}
+
+int dictConnect(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    /** A stuck server must not hang the editor **/
+    struct timeval timeout = {DICT_TIMEOUT_MS / 1000, DICT_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+void dictBatchReset(struct dictBatch *b)
+{
+    b->size = 0;
+    b->n = 0;
+}
+
+bool dictBatchAdd(struct dictBatch *b, const char *word, int len)
+{
+    if (b->n == DICT_BATCH || len > LENGTH)
+        return false;
+    char *p = b->buf + DICT_HEADER + b->size;
+    *p = len;
+    memcpy(p + 1, word, len);
+    b->size += len + 1;
+    b->n++;
+    return true;
+}
+
+/**
+ * The header is written in front of the words, hence the whole
+ * request goes out in one write.
+ */
+int dictCheck(int fd, struct dictBatch *b, unsigned char *known)
+{
+    if (b->n == 0)
+        return 0;
+    packHeader(b->buf, DICT_CHECK, b->n, b->size);
+    if (writeFull(fd, b->buf, DICT_HEADER + b->size) == -1)
+        return -1;
+    return readFull(fd, known, (b->n + 7) / 8);
+}
+
+int dictSuggest(int fd, const char *word, char out[][LENGTH + 1], int max)
+{
+    char req[DICT_HEADER + LENGTH + 1];
+    int len = strlen(word);
+    if (len > LENGTH)
+        return 0;
+    packHeader(req, DICT_SUGGEST, 1, len + 1);
+    req[DICT_HEADER] = len;
+    memcpy(req + DICT_HEADER + 1, word, len);
+    if (writeFull(fd, req, DICT_HEADER + len + 1) == -1)
+        return -1;
+
+    uint32_t n;
+    if (readFull(fd, &n, 4) == -1 || n > DICT_SUGGESTIONS)
+        return -1;
+    int kept = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        unsigned char wlen;
+        char w[LENGTH + 1];
+        if (readFull(fd, &wlen, 1) == -1 || wlen > LENGTH
+            || readFull(fd, w, wlen) == -1)
+            return -1;
+        w[wlen] = '\0';
+        if (kept < max)
+            strcpy(out[kept++], w);
+    }
+    return kept;
+}
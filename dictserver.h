@@ -0,0 +1,70 @@
+#ifndef DICTSERVER_H
+#define DICTSERVER_H
+#include "dictionary.h"
+
+/** Where the server of a user listens, unless told otherwise.
+ * %u is the user id, only that user may connect. **/
+#define DICT_SOCKET "/tmp/editor-dict-%u.sock"
+
+/** The most editors served at once, more are refused and check
+ * on their own **/
+#define DICT_MAX_CLIENTS 64
+
+/** The most words a request carries **/
+#define DICT_BATCH 4096
+
+/** The longest wait for a reply before the editor checks on
+ * its own **/
+#define DICT_TIMEOUT_MS 2000
+
+/** The most suggestions a reply carries **/
+#define DICT_SUGGESTIONS 16
+
+/** Requests. Every request is a header followed by its words,
+ * each a length byte and its letters:
+ *
+ *   header:  op u32, count u32, size u32 (bytes of the words)
+ *   check:   reply is count bits, 1 if the word is known
+ *   suggest: one word, reply is n u32 then n words **/
+enum dictOp {
+    DICT_CHECK = 1,
+    DICT_SUGGEST
+};
+
+#define DICT_HEADER 12
+
+/** Words gathered to be sent in a single request **/
+struct dictBatch {
+    char buf[DICT_HEADER + DICT_BATCH * (LENGTH + 1)];
+    int size;       /* Bytes of words in buf, after the header */
+    int n;          /* Number of words */
+};
+
+/** Returns the socket of the user's server, DICT_SOCKET **/
+const char *dictDefaultSocket(void);
+
+/** Loads the dictionary and answers requests on the socket at
+ * path until killed. Returns 1 if it can't start. **/
+int dictServe(const char *path);
+
+/** Connects to the server at path. Returns the socket, -1 if no
+ * server answers. **/
+int dictConnect(const char *path);
+
+/** Empties a batch **/
+void dictBatchReset(struct dictBatch *b);
+
+/** Adds a word of len letters to a batch. Returns false if the
+ * batch is full or the word too long. **/
+bool dictBatchAdd(struct dictBatch *b, const char *word, int len);
+
+/** Checks the words of a batch with one request. Sets bit i of
+ * known, (n + 7) / 8 bytes, if word i is in the dictionary.
+ * Returns 0 if successful, -1 if the server is gone. **/
+int dictCheck(int fd, struct dictBatch *b, unsigned char *known);
+
+/** Asks for words one edit away from word. Returns their number,
+ * at most max, or -1 if the server is gone. **/
+int dictSuggest(int fd, const char *word, char out[][LENGTH + 1], int max);
+
+#endif
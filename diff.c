@@ -0,0 +1,323 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "diff.h"
+
+/**
+ * FNV-1a hash of a line.
+ * @param s is the line, len its length.
+ */
+unsigned long long lineHash(const char *s, int len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+    return h ^ (unsigned long long) len;
+}
+
+/**
+ * Returns whether line i of a and line j of b are equal. The
+ * hashes tell most lines apart, equal ones are confirmed.
+ */
+static inline bool sameLine(const struct diffText *a, int i,
+    const struct diffText *b, int j)
+{
+    if (a->hash[i] != b->hash[j])
+        return false;
+    if (a->line == NULL || b->line == NULL)
+        return true;
+    return a->len[i] == b->len[j]
+        && memcmp(a->line[i], b->line[j], a->len[i]) == 0;
+}
+
+/** The edit script under construction **/
+typedef struct script {
+    struct diffOp *ops;
+    int n, cap;
+} script;
+
+/**
+ * Adds n lines of a type to the script, merged with the
+ * last run if it has the same type.
+ * @return 0 if successful, -1 if out of memory.
+ */
+static int push(script *s, int type, int a, int b, int n)
+{
+    if (n <= 0)
+        return 0;
+    if (s->n > 0 && s->ops[s->n - 1].type == type) {
+        s->ops[s->n - 1].n += n;
+        return 0;
+    }
+    if (s->n == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 16;
+        struct diffOp *ops = realloc(s->ops, sizeof(*ops) * cap);
+        if (ops == NULL)
+            return -1;
+        s->ops = ops;
+        s->cap = cap;
+    }
+    s->ops[s->n].type = type;
+    s->ops[s->n].a = a;
+    s->ops[s->n].b = b;
+    s->ops[s->n].n = n;
+    s->n++;
+    return 0;
+}
+
+/** A single line step found while backtracking **/
+typedef struct step {
+    int type;
+    int a, b;
+} step;
+
+/**
+ * Myers' O(ND) greedy algorithm. For every number of
+ * differences d, the furthest reaching path on each diagonal k
+ * is extended, and V[-d..d] is kept in a trace to walk the path
+ * back. Memory is O(D^2).
+ * @param pa, pb are where the n lines of a and m lines of b
+ * that are diffed start.
+ * @return 0 if successful, 1 if there are over DIFF_MAX_D
+ * differences, -1 if out of memory.
+ */
+static int myers(const struct diffText *a, int pa, int n,
+    const struct diffText *b, int pb, int m, script *s)
+{
+    int max = n + m;
+    if (max > DIFF_MAX_D)
+        max = DIFF_MAX_D;
+    int *v = malloc(sizeof(int) * (2 * max + 3));
+    int **trace = malloc(sizeof(int *) * (max + 1));
+    if (v == NULL || trace == NULL) {
+        free(v);
+        free(trace);
+        return -1;
+    }
+    int off = max + 1;
+    v[off + 1] = 0;
+
+    int D = -1;
+    for (int d = 0; d <= max && D == -1; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x;
+            if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+                x = v[off + k + 1];     // down, an insertion
+            else
+                x = v[off + k - 1] + 1; // right, a deletion
+            int y = x - k;
+            while (x < n && y < m && sameLine(a, pa + x, b, pb + y)) {
+                x++;
+                y++;
+            }
+            v[off + k] = x;
+            if (x >= n && y >= m)
+                D = d;
+        }
+        trace[d] = malloc(sizeof(int) * (2 * d + 1));
+        if (trace[d] == NULL) {
+            for (int i = 0; i < d; i++)
+                free(trace[i]);
+            free(trace);
+            free(v);
+            return -1;
+        }
+        memcpy(trace[d], &v[off - d], sizeof(int) * (2 * d + 1));
+        if (D == -1 && d == max) {
+            for (int i = 0; i <= d; i++)
+                free(trace[i]);
+            free(trace);
+            free(v);
+            return 1;
+        }
+    }
+    free(v);
+
+    /** Walk back from the end, collecting the steps **/
+    step *steps = malloc(sizeof(step) * (n + m + 1));
+    int nsteps = 0;
+    int x = n, y = m, err = steps ? 0 : -1;
+    for (int d = D; d > 0 && !err; d--) {
+        int *pv = trace[d - 1] + (d - 1);   // pv[k] for k in -(d-1)..d-1
+        int k = x - y;
+        int pk = (k == -d || (k != d && pv[k - 1] < pv[k + 1])) ? k + 1 : k - 1;
+        int px = pv[pk], py = px - pk;
+        while (x > px && y > py) {
+            x--;
+            y--;
+            steps[nsteps++] = (step) {DIFF_EQUAL, x, y};
+        }
+        if (x == px)
+            steps[nsteps++] = (step) {DIFF_INSERT, x, --y};
+        else
+            steps[nsteps++] = (step) {DIFF_DELETE, --x, y};
+    }
+    while (!err && x > 0 && y > 0) {
+        x--;
+        y--;
+        steps[nsteps++] = (step) {DIFF_EQUAL, x, y};
+    }
+
+    for (int i = nsteps - 1; i >= 0 && !err; i--)
+        err = push(s, steps[i].type, pa + steps[i].a, pb + steps[i].b, 1);
+    for (int d = 0; d <= D; d++)
+        free(trace[d]);
+    free(trace);
+    free(steps);
+    return err;
+}
+
+/**
+ * Diffs two texts line by line. The common first and last
+ * lines are trimmed before the O(ND) search runs on what is
+ * left.
+ * @param a is the old text, b the new one.
+ * @param ops is set to the runs of the edit script.
+ * @return the number of runs, -1 if out of memory.
+ */
+int diffLines(const struct diffText *a, const struct diffText *b,
+    struct diffOp **ops)
+{
+    script s = {NULL, 0, 0};
+    int n = a->n, m = b->n;
+    int pre = 0, suf = 0;
+    while (pre < n && pre < m && sameLine(a, pre, b, pre))
+        pre++;
+    while (suf < n - pre && suf < m - pre
+        && sameLine(a, n - 1 - suf, b, m - 1 - suf))
+        suf++;
+
+    int err = push(&s, DIFF_EQUAL, 0, 0, pre);
+    if (!err) {
+        err = myers(a, pre, n - pre - suf, b, pre, m - pre - suf, &s);
+        if (err == 1) {
+            /** Too different, replace the middle as a whole **/
+            err = push(&s, DIFF_DELETE, pre, pre, n - pre - suf);
+            if (!err)
+                err = push(&s, DIFF_INSERT, n - suf, pre, m - pre - suf);
+        }
+    }
+    if (!err)
+        err = push(&s, DIFF_EQUAL, n - suf, m - suf, suf);
+    if (err) {
+        free(s.ops);
+        return -1;
+    }
+    *ops = s.ops;
+    return s.n;
+}
+
+/** A changed region: base lines a0 to a1 became b0 to b1 **/
+typedef struct hunk {
+    int a0, a1, b0, b1;
+} hunk;
+
+/**
+ * Groups the runs of an edit script into hunks, every run of
+ * deletes and inserts between two equal runs makes one.
+ * @return the number of hunks, -1 if out of memory.
+ */
+static int hunks(struct diffOp *ops, int nops, hunk **out)
+{
+    hunk *h = malloc(sizeof(hunk) * (nops + 1));
+    if (h == NULL)
+        return -1;
+    int n = 0;
+    for (int i = 0; i < nops; i++) {
+        if (ops[i].type == DIFF_EQUAL)
+            continue;
+        hunk *k = &h[n++];
+        k->a0 = k->a1 = ops[i].a;
+        k->b0 = k->b1 = ops[i].b;
+        for (; i < nops && ops[i].type != DIFF_EQUAL; i++) {
+            if (ops[i].type == DIFF_DELETE)
+                k->a1 = ops[i].a + ops[i].n;
+            else
+                k->b1 = ops[i].b + ops[i].n;
+        }
+    }
+    *out = h;
+    return n;
+}
+
+/**
+ * Diffs base against both versions and walks the hunks in base
+ * order. Hunks of the two sides that overlap or touch are put in
+ * one cluster. A cluster changed by theirs only is taken from
+ * theirs. One changed by both is a conflict, unless both made the
+ * same lines. delta tracks how far each version has moved away
+ * from base, mapping base lines outside of hunks.
+ */
+int diffMerge(const struct diffText *base, const struct diffText *mine,
+    const struct diffText *theirs, struct mergeChunk **chunks)
+{
+    struct diffOp *ops1 = NULL, *ops2 = NULL;
+    hunk *h1 = NULL, *h2 = NULL;
+    struct mergeChunk *out = NULL;
+    int n1 = -1, n2 = -1, n = -1;
+
+    int nops1 = diffLines(base, mine, &ops1);
+    int nops2 = nops1 == -1 ? -1 : diffLines(base, theirs, &ops2);
+    if (nops2 != -1) {
+        n1 = hunks(ops1, nops1, &h1);
+        n2 = n1 == -1 ? -1 : hunks(ops2, nops2, &h2);
+    }
+    if (n2 != -1)
+        out = malloc(sizeof(struct mergeChunk) * (n1 + n2 + 1));
+    if (out != NULL) {
+        n = 0;
+        int i1 = 0, i2 = 0, delta1 = 0, delta2 = 0;
+        while (i1 < n1 || i2 < n2) {
+            /** Start the cluster at the first hunk **/
+            int c0;
+            if (i2 == n2 || (i1 < n1 && h1[i1].a0 <= h2[i2].a0))
+                c0 = h1[i1].a0;
+            else
+                c0 = h2[i2].a0;
+            int c1 = c0, m0 = c0 + delta1, t0 = c0 + delta2;
+            bool ours = false, other = false;
+            while (true) {
+                if (i1 < n1 && h1[i1].a0 <= c1) {
+                    if (h1[i1].a1 > c1)
+                        c1 = h1[i1].a1;
+                    delta1 += (h1[i1].b1 - h1[i1].b0) - (h1[i1].a1 - h1[i1].a0);
+                    ours = true;
+                    i1++;
+                } else if (i2 < n2 && h2[i2].a0 <= c1) {
+                    if (h2[i2].a1 > c1)
+                        c1 = h2[i2].a1;
+                    delta2 += (h2[i2].b1 - h2[i2].b0) - (h2[i2].a1 - h2[i2].a0);
+                    other = true;
+                    i2++;
+                } else {
+                    break;
+                }
+            }
+            if (!other)
+                continue;
+            struct mergeChunk *c = &out[n];
+            c->m = m0;
+            c->mn = c1 + delta1 - m0;
+            c->t = t0;
+            c->tn = c1 + delta2 - t0;
+            c->conflict = ours;
+            if (ours && c->mn == c->tn) {
+                int k = 0;
+                while (k < c->mn && sameLine(mine, c->m + k, theirs, c->t + k))
+                    k++;
+                if (k == c->mn)
+                    continue;
+            }
+            n++;
+        }
+    }
+    free(ops1);
+    free(ops2);
+    free(h1);
+    free(h2);
+    if (n == -1)
+        free(out);
+    else
+        *chunks = out;
+    return n;
+}
@@ -0,0 +1,59 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+/** Types of runs in an edit script **/
+enum diffType {
+    DIFF_EQUAL,     /* lines kept from a to b */
+    DIFF_DELETE,    /* lines of a that are not in b */
+    DIFF_INSERT     /* lines of b that are not in a */
+};
+
+/** A run of n lines, starting at line a of the old text and
+ * line b of the new one **/
+struct diffOp {
+    int type;
+    int a, b;
+    int n;
+};
+
+/** Past this many differences, lines deleted plus inserted, the
+ * middle of the texts is given as deleted and inserted as a whole.
+ * The search keeps O(DIFF_MAX_D^2) ints, about 16MB at most. **/
+#define DIFF_MAX_D 2048
+
+/** Hashes a line, lines with different hashes differ **/
+unsigned long long lineHash(const char *s, int len);
+
+/** The n lines of a text and their hashes. Lines with equal
+ * hashes are compared byte by byte, unless line is NULL for a
+ * text only known by its hashes. **/
+struct diffText {
+    const unsigned long long *hash;
+    char *const *line;
+    const int *len;
+    int n;
+};
+
+/** Finds a shortest edit script from the lines of a to the lines
+ * of b. Sets ops to the runs, which the caller frees. Returns
+ * their number, -1 on error. **/
+int diffLines(const struct diffText *a, const struct diffText *b,
+    struct diffOp **ops);
+
+/** A region where the other version changed: n lines of mine
+ * starting at m are replaced by theirs, or if conflict is true
+ * both versions changed it differently **/
+struct mergeChunk {
+    int m, mn;      /* Lines of mine */
+    int t, tn;      /* Lines of theirs */
+    int conflict;
+};
+
+/** Merges the changes made to base in mine and in theirs.
+ * Changes only in mine are kept as they are, chunks tell what to
+ * take from theirs. Sets chunks to them, in order, which the
+ * caller frees. Returns their number, -1 on error. **/
+int diffMerge(const struct diffText *base, const struct diffText *mine,
+    const struct diffText *theirs, struct mergeChunk **chunks);
+
+#endif
@@ -4,6 +4,7 @@
 
 
 /** Links **/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -19,6 +20,21 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include "pool.h"
+#include "journal.h"
+#include "trace.h"
+#include "changelog.h"
+#include "diff.h"
+#include "recover.h"
+#include "dictserver.h"
 
 
 /** Definitions **/
@@ -31,7 +47,23 @@
 #define ESC 0x001b
 #define BACKSPACE 127
 #define TABS 8
-#define INIT_CURSOR "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1
+#define LONG_LINE 65536
+#define LONG_SLICE 8192
+#define LONG_MARGIN 1024
+#define FRAME_MS 16
+#define ESC_MS 25
+#define INPUT_SIZE 4096
+#define MESSAGE_MS 5000
+#define COPY_CHUNK (64 << 20)
+#define COPY_BUFFER (1 << 20)
+#define APPEND_BUFFER (1 << 20)
+#define DIFF_CONTEXT 3
+#define RECOVER_MS 1000
+#define RECOVER_IDLE_MS 200
+#define PASTE_ON "\x1b[?2004h", 8
+#define PASTE_OFF "\x1b[?2004l", 8
+#define PASTE_END "\x1b[201~"
+#define INIT_CURSOR(y, x) "\x1b[%d;%dH", (y) + 1, (x) + 1
 /** Init cursor initializes the cursor within limits of the read file and window size **/
 
 /** The control keys **/
@@ -42,22 +74,53 @@ enum editorKey {
   ARROW_DOWN,
   DEL_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  HOME_KEY,
+  END_KEY,
+  PASTE_START
 };
 
+/** Modifiers reported along with a key **/
+#define KEY_SHIFT (1 << 16)
+#define KEY_ALT (1 << 17)
+#define KEY_CTRL (1 << 18)
+#define KEY_MODS (KEY_SHIFT | KEY_ALT | KEY_CTRL)
+
 /** Used for the spell checker **/
 enum wordType {
   NORMAL = 0,
   MISSPELLED
 };
 
-/** Holds each row of a read file **/
+/** What the change log browser shows **/
+enum logViewType {
+  LOG_LIST = 0,     /* The revisions, one per row */
+  LOG_REVISION,     /* The text of a revision */
+  LOG_DIFF          /* A unified diff between two revisions */
+};
+
+/** Row state bits **/
+enum rowFlags {
+  ROW_SLICED = 1,       /* Only a slice of the long row is rendered */
+  ROW_PINNED = 2,       /* chars is part of a save in progress */
+  ROW_STALE = 4         /* render wasn't made for the current chars */
+};
+
+/** Holds the rows of a read file as parallel arrays, hence
+ *  whole document scans only stride over the fields they use **/
 typedef struct rows {
-  int size;       /* Size of chars */
-  char *chars;    /* String of data, a single row */
-  int rsize;      /* Size of rendered row */
-  char *render;   /* The rendered string of data */
-  unsigned char *hl;
+  int *size;            /* Size of chars */
+  int *rsize;           /* Size of rendered row */
+  int *rstart;          /* Rendered column render starts at */
+  char **chars;         /* String of data, a single row */
+  char **render;        /* The rendered string of data */
+  unsigned char **hl;   /* Highlighting of the rendered string */
+  int *ccap;            /* Capacity of chars */
+  int *rcap;            /* Capacity of render and hl */
+  unsigned char *flags; /* Row state bits */
+  int **tabs;           /* Column map: position and rendered end of each tab */
+  int *ntabs;           /* Number of tabs, -1 if the map isn't built */
+  int cap;              /* Number of rows the arrays can hold */
 } rows;
 
 
@@ -67,18 +130,187 @@ struct editorData {
   int rowoff, coloff;          /** Window offset values **/
   int screenrows, screencols;  /** Window size **/
   int numrows;                 /** Number of lines read to buffer **/
-  rows *row;                   /** The array of row structures **/
+  rows row;                    /** The table of rows **/
   char *filename;              /** Name of loaded file **/
   char statusmsg[128];         /** Status bar message **/
-  time_t statusmsg_time;       /** Timer for message bar **/
+  long long statusmsg_time;    /** When the message expires, in ms **/
   bool modified;               /** Records if buffer is modified **/
+  unsigned long long editseq;  /** Counts the modifications **/
   struct termios terminal;     /** Terminal properties **/
   bool highlight;              /** Spell checker highlighter **/
   int start,end;               /** Misspelled words range **/
+  struct journal journal;      /** Undo/redo operations **/
+  bool softwrap;               /** Rows wider than the window wrap, 
+                                   rowoff counts visual lines **/
+  bool traceoverlay;           /** Latencies shown on the status bar **/
+  bool mark;                   /** Selection anchor is set **/
+  bool deferrender;            /** Edited rows are marked stale
+                                   rather than rendered **/
+  int my, mx;                  /** Selection anchor **/
+};
+
+/** What the terminal currently shows, a hash of every
+ *  screen line as it was last written **/
+struct screen {
+  unsigned long long *hash;   /* Hash of each line, 0 if unknown */
+  int lines;                  /* Number of screen lines */
+  int rowoff;                 /* Row offset the lines were drawn at */
+  int bytes;                  /* Bytes written by the last frame */
+  int segments;               /* Pieces it was gathered from */
+  int allocs;                 /* Reallocations while building it */
+  long long buildns;          /* Time taken to build it */
+};
+
+/** Settings given on the command line **/
+struct options {
+  int framems;    /* Minimum time between two frames */
+  int escms;      /* Time to wait for the rest of an escape sequence */
+  int recoverms;  /* Longest time edits wait to reach the recovery journal */
+  const char *dictsocket;   /* Where the dictionary server listens */
+};
+
+/** Bytes read from the terminal but not yet processed **/
+struct input {
+  unsigned char buf[INPUT_SIZE];  /* Ring buffer */
+  int head;                       /* Index of the oldest byte */
+  int len;                        /* Number of bytes held */
+};
+
+/** The soft-wrap layout, the number of visual lines of every
+ *  row and a Fenwick tree of them **/
+struct wrap {
+  int *count;     /* Visual lines of each row */
+  int *tree;      /* Fenwick tree over count, 1-based */
+  int n;          /* Number of rows laid out */
+  int cap;        /* Rows the arrays can hold */
+  int width;      /* Window width the layout is for */
+  bool valid;     /* Rows weren't added or removed since */
+};
+
+/** What the main loop waits on besides the terminal **/
+struct events {
+  int winch[2];   /* Self-pipe written when the window is resized */
+  int timer;      /* timerfd that fires when the message expires */
+  int saved[2];   /* Pipe written when a background save ends */
+  int inotify;    /* Watches the directories of the open files */
+  volatile sig_atomic_t quit;   /* SIGHUP or SIGTERM that came */
+};
+
+/** The rows as they were when a save began **/
+struct snapshot {
+  char **chars;       /* Text of each row, pinned */
+  int *size;          /* Size of each row */
+  int numrows;
+  char *filename;
+};
+
+/** A save running on a worker thread. Rows are pinned rather
+ *  than copied: the text of a pinned row is copied before it
+ *  is edited, and its block is only freed once the save ends **/
+struct save {
+  pthread_t thread;
+  bool running;                 /* A save wasn't finished yet */
+  bool threaded;                /* It runs on the thread */
+  struct snapshot snap;
+  unsigned long long editseq;   /* editseq when the save began */
+  long long journaled;          /* Size of the recovery journal then */
+  int err;                      /* errno of the failure, 0 if none */
+  void **deferred;              /* Blocks to free when it ends */
+  int *defcap;                  /* Their capacities */
+  int ndeferred, capdeferred;
+};
+
+/** The change log browsed with --log. Only its index is
+ *  read up front, revisions are read when they are shown **/
+struct logView {
+  bool open;              /* The editor is browsing a log */
+  struct changeLog log;
+  int view;               /* LOG_LIST, LOG_REVISION or LOG_DIFF */
+  int from, to;           /* Revisions shown, from is -1 for one */
+  int mark;               /* Revision diffs start from, -1 if none */
+  int cy, rowoff;         /* Position in the list */
+  char title[64];         /* Shown on the status bar */
+};
+
+/** A text split into lines that point into it **/
+struct textLines {
+  char *text;
+  size_t size;
+  char **line;
+  int *len;
+  unsigned long long *hash;
+  int n;
+};
+
+/** The loaded file watched for changes made by other programs.
+ *  The version the rows came from is the base of a merge **/
+struct watch {
+  int wd;                       /* Watch on the directory of the file */
+  char *name;                   /* Name of the file in it */
+  struct recoverBase known;     /* Version the rows came from */
+  bool newline;                 /* It ends with a newline */
+  unsigned long long *hash;     /* Hashes of its lines */
+  int nhash;
+  bool pending;                 /* Changed while a save was running */
+  bool follow;                  /* The cursor follows the end of the file */
+};
+
+/** An open file. The one shown lives in E and the globals
+ *  below, its slot is only written when another is shown **/
+struct buffer {
+  struct editorData E;
+  struct watch watch;
+  struct recovery recovery;
+  struct wrap wrap;
+};
+
+/** The open files, the row allocator is shared by them **/
+struct buffers {
+  struct buffer *list;
+  int n, cap;
+  int cur;          /* The buffer shown */
+};
+
+/** What woke the main loop up **/
+#define EVENT_INPUT 1   /* Keys can be read */
+#define EVENT_REDRAW 2  /* The screen must be drawn again */
+
+/** Where words are checked: a dictionary server if one
+ *  answers, else the trie built in the editor **/
+struct speller {
+  int fd;         /* Connection to the server, -1 if none */
+  bool loaded;    /* The trie was built */
+};
+
+/** Rows set aside while a journal is replayed, hence an
+ *  edit only moves the rows up to the ones it reaches **/
+struct aside {
+  rows row;         /* The rows, the last one of the file first */
+  int n;            /* Number of rows */
+};
+
+/** Text that was cut or copied **/
+struct clipboard {
+  char *text;
+  int len;
 };
 
 /** Global declarations **/
 struct editorData E;
+struct clipboard clipboard;
+struct logView logview = {.mark = -1};
+struct input input;
+struct events events = {{-1, -1}, -1, {-1, -1}, -1, 0};
+struct save save;
+struct wrap wrap;
+struct screen screen;
+struct options options = {FRAME_MS, ESC_MS, RECOVER_MS, NULL};
+struct recovery recovery = {.fd = -1};
+struct watch watch = {.wd = -1};
+struct buffers buffers;
+struct pool pool;
+struct speller speller = {-1, false};
+struct aside aside;
 struct editorBuffer editorBuffer;
 void modifyTerminal();
 void initialize();
@@ -87,39 +319,173 @@ int readKey();
 void processKeypress();
 void getWindowSize();
 void showChangeLog(char *filename);
-void appendChangeLog(char *buf, int len);
+void appendChangeLog(struct snapshot *snap);
+bool logKeypress(int c);
+void logList();
 void scroll();
 void die(const char *s);
 
 void displayScreen();
+void invalidateScreen();
+void scrollScreen(struct editorBuffer *ab);
+struct bufferMark lineBegin(struct editorBuffer *ab, int y);
+void lineEnd(struct editorBuffer *ab, int y, struct bufferMark mark);
 void displayRows(struct editorBuffer *ab);
 void displayStatusBar(struct editorBuffer *ab);
 void displayMessageBar(struct editorBuffer *ab);
 void setMessage(const char *fmt, ...);
 void writeRow(int index, char *line, size_t len);
-void renderRow(rows *row);
+void growTable(rows *t, int n);
+void moveRow(rows *to, int t, rows *from, int f);
+void freeTable(rows *t);
+void replayWindow(int need);
+void fillRow(int at, const char *line, size_t len);
+void renderRow(int at);
+void updateRow(int at);
+void removeRow(int at);
+void recordInsert(int y, int x, const char *s, int len, int flags);
+op *recordOp(int type, int y, int x, const char *s, int len, int flags);
 
 void loadFile(char*);
+size_t trimLine(const char *line, size_t len);
+bool splitLines(struct textLines *t, char *text, size_t len);
+void freeLines(struct textLines *t);
+void closeFile();
+void saveFile();
 void deleteFile();
 void copyFile();
 
 void appendLine(char *filename, char *s);
+int appendStream(char *filename);
+int writeAll(int fd, struct iovec *iov, int cnt);
 char* prompter();
-void highlightWords(rows *row);
+void highlightWords(int at);
+void memoryStats();
+int readInput(char *buf, int len);
+void inputUnread(const char *s, int len);
+bool waitInput(int timeout);
+void insertAtCursor(const char *s, int len);
+bool getSelection(int *y1, int *x1, int *y2, int *x2);
+int rowCxToRx(int at, int cx);
+int rowRxToCx(int at, int rx);
+void dropColumnMap(int at);
+void renderSlice(int at, int col);
+int renderedLength(int at);
+int tableRenderedLength(rows *t, int at);
+int visualPrefix(int at);
+int visualRow(int v, int *sub);
+void wrapUpdate(int at);
+void toggleWrap();
+int traceStatus(char *buf, int size);
+void toggleTrace();
+int parseOptions(int argc, char *argv[]);
+long long monotonicMs();
+bool inputPending(int timeout);
+void initEvents();
+void setModified();
+void unpinRow(int at);
+void deferFree(void *p, int cap);
+void waitSave();
+void finishSave();
+void armTimer(int ms);
+int waitEvents(int timeout);
+void recoverFile();
+void startRecovery(const char *filename, struct recoverBase base);
+int recoveryDue();
+void recoverEdit(int type, int y, int x, const char *s, int len);
+struct recoverBase fileBase(const char *filename);
+void watchFile(const char *filename);
+bool endsWithNewline(const char *filename);
+unsigned long long *rowHashes();
+struct diffText rowText(const unsigned long long *hash);
+struct diffText linesText(const struct textLines *t);
+void setKnown(struct recoverBase base, unsigned long long *hash, int n,
+  bool newline);
+bool watchEvents();
+void replaceRows(int at, int count, char **line, int *len, int n);
+int mapRow(struct diffOp *ops, int nops, int y, int m);
+int reloadRows(struct textLines *t, struct recoverBase base);
+void resyncRecovery(struct textLines *t);
+int mergeRows(struct textLines *t, struct recoverBase base);
+bool appendTail(struct recoverBase base);
+bool readDisk(struct textLines *t, struct recoverBase *base);
+void checkFile();
+void toggleFollow();
+void dropWatch();
+void stashBuffer();
+void showBuffer(int i);
+void switchBuffer(int step);
+bool newBuffer(const char *filename);
+void openBuffer();
+void closeBuffer();
+void loadTrie();
+bool connectSpeller();
+void dropSpeller();
+void highlightMisspelling(int at, int start, int end);
+int spellCheckServer();
+int spellCheckLocal();
+void suggestWord();
 
 
 /** Starting point **/
 int main(int argc, char *argv[]) {
+  /** The dictionary server and appending run without the
+   *  terminal, from scripts. Options are taken out first **/
+  argc = parseOptions(argc, argv);
+  if (argc >= 2 && strcmp(argv[1], "--dict-server") == 0)
+    return dictServe(argc > 2 ? argv[2] : dictDefaultSocket());
+  if (argc == 4 && strcmp(argv[1], "--append") == 0) {
+    if (strcmp(argv[3], "-") == 0) return appendStream(argv[2]);
+    appendLine(argv[2], argv[3]);
+    return 0;
+  }
+
   modifyTerminal(); 
   initialize();
-  args(argc, argv);
-
+  initEvents();
   setMessage("Ctrl-Q = QUIT | Ctrl-X = HELP | Ctrl-S = SAVE | Ctrl-F = SPELLCHECK | Ctrl-C = COPY FILE | Ctrl-D = DELETE FILE");
+  args(argc, argv);
 
-  /** Editor screen flow **/
+  /** Editor screen flow. All pending keys are processed
+   *  before a frame is drawn, and frames are drawn at most once
+   *  per frame interval **/
+  bool dirty = true;
+  long long lastframe = 0;
+  long long keyat = 0; // first key processed since the last frame
   while (1) {
-    displayScreen();
-    processKeypress();
+    int wait = -1;
+    if (dirty) {
+      wait = lastframe + options.framems - monotonicMs();
+      if (wait <= 0) {
+        displayScreen();
+        lastframe = monotonicMs();
+        dirty = false;
+        wait = -1;
+        if (keyat) traceEnd(TRACE_LATENCY, keyat);
+        keyat = 0;
+      }
+    }
+
+    /** Edits reach the recovery journal off the key path **/
+    int due = recoveryDue();
+    if (due == 0) {
+      recoverFlush(&recovery);
+      due = -1;
+    }
+    if (due > 0 && (wait == -1 || due < wait)) wait = due;
+
+    /** Sleep until a key, a resize or the message timer
+     *  comes, or the next frame or journal flush is due **/
+    int ev = input.len > 0 ? EVENT_INPUT : waitEvents(wait);
+    if (ev & EVENT_REDRAW) dirty = true;
+    if (!(ev & EVENT_INPUT)) continue;
+    do {
+      long long t = traceNow();
+      if (!keyat) keyat = t;
+      processKeypress();
+      traceEnd(TRACE_KEY, t);
+      dirty = true;
+    } while (monotonicMs() - lastframe < options.framems && inputPending(0));
   }
 
   return 0;
@@ -142,10 +508,15 @@ void initialize() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  memset(&E.row, 0, sizeof(E.row));
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
+  buffers.cap = 4;
+  buffers.list = malloc(sizeof(struct buffer) * buffers.cap);
+  if (buffers.list == NULL) die("malloc");
+  buffers.n = 1;
+  buffers.cur = 0;
   getWindowSize();
   E.screenrows -= 2; // for the bottom two status bars
 }
@@ -153,8 +524,9 @@ void initialize() {
 /**
  * Given the arguments that the user passed from the 
  * command line, parses them and directs the editor.
- * Possible flags: --help, --append, --log.
- * @param argc the number of arguments passed
+ * Possible flags: --help, --append, --log. Several files
+ * are opened in buffers of their own.
+ * @param argc the number of arguments left by parseOptions
  * @param argv the array of passed arguments
  */ 
 void args(int argc, char *argv[]) {
@@ -164,6 +536,8 @@ void args(int argc, char *argv[]) {
       loadFile("help.txt");
     } else {
       loadFile(argv[1]);
+      watchFile(argv[1]);
+      recoverFile();
     }
   }
 
@@ -171,12 +545,15 @@ void args(int argc, char *argv[]) {
     if (strcmp(argv[1], "--log")==0) {
       showChangeLog(argv[2]);
     } else if (strcmp(argv[1], "--append")==0) {
-      if (argc == 4) {
-        appendLine(argv[2], argv[3]);
-        exit(0);
-      }
-      else
-        loadFile("help.txt");
+      /** main appends, this is a malformed --append **/
+      loadFile("help.txt");
+    } else if (strncmp(argv[1], "--", 2) != 0) {
+      loadFile(argv[1]);
+      watchFile(argv[1]);
+      recoverFile();
+      for (int i = 2; i < argc; i++) newBuffer(argv[i]);
+      stashBuffer();
+      showBuffer(0);
     } else {
       message = "Flag not found, Try '--help'\r\n";
       write(STDOUT_FILENO, message, strlen(message));
@@ -187,18 +564,239 @@ void args(int argc, char *argv[]) {
  }
 
 
+/**
+ * Takes the options that can be given along with any flag
+ * out of the arguments:
+ * --frame-ms <n>   draw at most one frame every n milliseconds
+ * --esc-ms <n>     wait n milliseconds for the rest of an escape sequence
+ * --trace-out <f>  write the traced stages to f as Chrome trace JSON
+ * --recover-ms <n> write edits to the recovery journal at least every n ms
+ * --dict-socket <f> ask the dictionary server listening on f
+ * @param argc the number of arguments passed
+ * @param argv the array of passed arguments, options are removed
+ * @return the number of arguments left
+ */ 
+int parseOptions(int argc, char *argv[]) {
+  int n = 1;
+  options.dictsocket = dictDefaultSocket();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frame-ms") == 0 && i + 1 < argc) {
+      options.framems = atoi(argv[++i]);
+      if (options.framems < 0) options.framems = 0;
+    } else if (strcmp(argv[i], "--esc-ms") == 0 && i + 1 < argc) {
+      options.escms = atoi(argv[++i]);
+      if (options.escms < 0) options.escms = 0;
+    } else if (strcmp(argv[i], "--trace-out") == 0 && i + 1 < argc) {
+      if (!traceOpen(argv[++i])) die("trace");
+    } else if (strcmp(argv[i], "--recover-ms") == 0 && i + 1 < argc) {
+      options.recoverms = atoi(argv[++i]);
+      if (options.recoverms < 0) options.recoverms = 0;
+    } else if (strcmp(argv[i], "--dict-socket") == 0 && i + 1 < argc) {
+      options.dictsocket = argv[++i];
+    } else {
+      argv[n++] = argv[i];
+    }
+  }
+  argv[n] = NULL;
+  return n;
+}
+
+/**
+ * Returns a monotonic time in milliseconds.
+ */ 
+long long monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+/******************************************************************************
+*                               Event Loop                                    *
+******************************************************************************/
+
+/**
+ * Called on SIGWINCH, wakes the main loop up through
+ * the self-pipe.
+ */ 
+void handleResize(int sig) {
+  (void) sig;
+  int saved = errno;
+  write(events.winch[1], "", 1);
+  errno = saved;
+}
+
+/**
+ * Called on SIGHUP and SIGTERM, the main loop writes the
+ * recovery journal and quits.
+ */ 
+void handleQuit(int sig) {
+  int saved = errno;
+  events.quit = sig;
+  write(events.winch[1], "", 1);
+  errno = saved;
+}
+
+/**
+ * Called when the editor crashes. The records already in
+ * the recovery journal are synced before the default action,
+ * the ones still buffered are lost.
+ */ 
+void handleCrash(int sig) {
+  recoverEmergency(&recovery);
+  raise(sig);
+}
+
+/**
+ * Creates the self-pipe for resizes and the message
+ * timer, and installs the signal handlers.
+ */ 
+void initEvents() {
+  if (pipe2(events.winch, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe");
+  if (pipe2(events.saved, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe");
+  events.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (events.timer == -1) die("timerfd_create");
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleResize;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+
+  sa.sa_handler = handleQuit;
+  if (sigaction(SIGHUP, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+    die("sigaction");
+  sa.sa_handler = handleCrash;
+  sa.sa_flags = SA_RESETHAND;
+  int crashes[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+  for (int i = 0; i < (int) (sizeof(crashes) / sizeof(crashes[0])); i++)
+    sigaction(crashes[i], &sa, NULL);
+}
+
+/**
+ * Arms the message timer.
+ * @param ms is the time until it fires.
+ */ 
+void armTimer(int ms) {
+  if (events.timer == -1) return;
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  timerfd_settime(events.timer, 0, &its, NULL);
+}
+
+/**
+ * Takes the new window size after a resize. The terminal
+ * reflows what it shows, so the next frame redraws it all.
+ */ 
+void resizeWindow() {
+  getWindowSize();
+  E.screenrows -= 2; // for the bottom two status bars
+  if (E.screenrows < 1) E.screenrows = 1;
+  write(STDOUT_FILENO, CLEAR_SCREEN);
+  invalidateScreen();
+}
+
+/**
+ * Sleeps until the terminal, the resize pipe, the
+ * message timer or the end of a save wakes the editor up,
+ * and handles all but the first. Nothing runs while the
+ * editor is idle.
+ * @param timeout in milliseconds, -1 to wait forever.
+ * @return the EVENT_ bits of what happened, 0 on timeout.
+ */ 
+int waitEvents(int timeout) {
+  struct pollfd pfd[5] = {
+    {STDIN_FILENO, POLLIN, 0},
+    {events.winch[0], POLLIN, 0},
+    {events.timer, POLLIN, 0},
+    {events.saved[0], POLLIN, 0},
+    {events.inotify, POLLIN, 0}
+  };
+  int n = poll(pfd, 5, timeout);
+  if (events.quit) {
+    /** The terminal may be gone, keep the edits and go **/
+    recoverClose(&recovery, false);
+    if (events.quit == SIGHUP) _exit(1);
+    exit(1);
+  }
+  if (n == -1) {
+    if (errno != EINTR) die("poll");
+    return 0;
+  }
+
+  int ev = 0;
+  if (pfd[0].revents) ev |= EVENT_INPUT;
+  if (pfd[1].revents) {
+    /** Several signals make a single resize **/
+    char buf[64];
+    while (read(events.winch[0], buf, sizeof(buf)) > 0);
+    resizeWindow();
+    ev |= EVENT_REDRAW;
+  }
+  if (pfd[2].revents) {
+    unsigned long long expirations;
+    read(events.timer, &expirations, sizeof(expirations));
+    ev |= EVENT_REDRAW;
+  }
+  if (pfd[3].revents) {
+    finishSave();
+    ev |= EVENT_REDRAW;
+  }
+  if (pfd[4].revents && watchEvents()) ev |= EVENT_REDRAW;
+  return ev;
+}
+
+
 /******************************************************************************
 *                          The Editing Buffer                                 *
 ******************************************************************************/
 
+/** A piece of the frame, either bytes copied into the
+ * buffer or text referenced where it lives */
+typedef struct segment {
+  const char *p;  /* Referenced text, NULL if copied into b */
+  int len;
+} segment;
+
 /** This structure is the editing buffer, it consists of 
- * a character array and its length */
+ * a character array and its length, and the segments
+ * the frame is gathered from. It is kept across frames */
 typedef struct editorBuffer {
   char *b;
-  int len;
+  int len, cap;
+  segment *seg;       /* Pieces of the frame in order */
+  int nseg, segcap;
+  struct iovec *iov;  /* Gathered at flush */
+  int iovcap;
+  bool split;         /* Next write starts a new segment */
+  int allocs;         /* Reallocations during this frame */
 } ebuffer;
 
-#define ABUF_INIT {NULL, 0}
+/** A position in the editing buffer to go back to **/
+typedef struct bufferMark {
+  int len, nseg;
+} bufferMark;
+
+/**
+ * Makes room for one more segment, its capacity doubles.
+ * @param editorBuffer is the editing buffer.
+ * @return the new segment, NULL if out of memory.
+ */
+segment *bufferSegment(struct editorBuffer *ab) {
+  if (ab->nseg == ab->segcap) {
+    int cap = ab->segcap ? ab->segcap * 2 : 256;
+    segment *new = realloc(ab->seg, sizeof(segment) * cap);
+    if (new == NULL) return NULL;
+    ab->seg = new;
+    ab->segcap = cap;
+    ab->allocs++;
+  }
+  ab->split = false;
+  return &ab->seg[ab->nseg++];
+}
 
 /**
  * Given a string of some length, write it to the editing 
@@ -208,26 +806,134 @@ typedef struct editorBuffer {
  * @param len is the length of the string to be written.
  */
 void bufferWrite(struct editorBuffer *ab, const char *s, int len) {
-  /** Reallocate space for the string to be written **/
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL) return;
-  /** If reallocation was successful, copy the string to the buffer
-   *  array **/
-  memcpy(&new[ab->len], s, len); // copy s to the buffer.
-  ab->b = new;
+  /** Reallocate space for the string to be written, the
+   *  capacity doubles hence this is rare **/
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) return;
+    ab->b = new;
+    ab->cap = cap;
+    ab->allocs++;
+  }
+
+  /** Extend the last segment if it is copied bytes **/
+  segment *seg = ab->nseg ? &ab->seg[ab->nseg - 1] : NULL;
+  if (seg == NULL || ab->split || seg->p != NULL) {
+    if ((seg = bufferSegment(ab)) == NULL) return;
+    seg->p = NULL;
+    seg->len = 0;
+  }
+  memcpy(&ab->b[ab->len], s, len); // copy s to the buffer.
   ab->len += len;
+  seg->len += len;
+}
+
+/**
+ * Given a string of some length, adds it to the frame
+ * without copying it. It must stay unchanged until the
+ * buffer is flushed.
+ * @param editorBuffer is the editing buffer.
+ * @param s is a string to be referenced.
+ * @param len is the length of the string.
+ */
+void bufferRef(struct editorBuffer *ab, const char *s, int len) {
+  if (len <= 0) return;
+  segment *seg = bufferSegment(ab);
+  if (seg == NULL) return;
+  seg->p = s;
+  seg->len = len;
+}
+
+/**
+ * Returns a mark of the current end of the buffer. The
+ * next write starts a new segment.
+ * @param editorBuffer is the editing buffer.
+ */
+bufferMark bufferTell(struct editorBuffer *ab) {
+  ab->split = true;
+  return (bufferMark) {ab->len, ab->nseg};
 }
 
 /**
- * Given the buffer structure, free the pointer. Hence, deletes
- * buffer contents.
+ * Drops everything written after a mark.
  * @param editorBuffer is the editing buffer.
+ * @param mark is a mark from bufferTell.
  */
-void bufferFree(struct editorBuffer *ab) {
-  free(ab->b);
+void bufferSeek(struct editorBuffer *ab, bufferMark mark) {
+  ab->len = mark.len;
+  ab->nseg = mark.nseg;
+  ab->split = true;
 }
 
+/**
+ * Writes every iovec to a file, in batches of IOV_MAX
+ * and carrying on after partial writes. The iovecs are
+ * changed along the way.
+ * @param fd is the file descriptor.
+ * @param iov is the iovecs, cnt their number.
+ * @return 0 if successful, -1 on error.
+ */
+int writeAll(int fd, struct iovec *iov, int cnt) {
+  while (cnt > 0) {
+    ssize_t n = writev(fd, iov, cnt < IOV_MAX ? cnt : IOV_MAX);
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return -1;
+    }
+    while (cnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Writes the buffer to standard output with a single
+ * writev per IOV_MAX segments, then empties it. The memory
+ * is kept for the next frame.
+ * @param editorBuffer is the editing buffer.
+ * @return the number of bytes written.
+ */
+int bufferFlush(struct editorBuffer *ab) {
+  if (ab->iovcap < ab->nseg) {
+    struct iovec *iov = realloc(ab->iov, sizeof(struct iovec) * ab->segcap);
+    /** The frame is dropped, the next one is drawn whole **/
+    if (iov == NULL) {
+      ab->len = 0;
+      ab->nseg = 0;
+      invalidateScreen();
+      return 0;
+    }
+    ab->iov = iov;
+    ab->iovcap = ab->segcap;
+    ab->allocs++;
+  }
+
+  /** Copied segments take their bytes from b in order **/
+  char *b = ab->b;
+  int total = 0;
+  for (int i = 0; i < ab->nseg; i++) {
+    ab->iov[i].iov_base = (void *) (ab->seg[i].p ? ab->seg[i].p : b);
+    ab->iov[i].iov_len = ab->seg[i].len;
+    if (ab->seg[i].p == NULL) b += ab->seg[i].len;
+    total += ab->seg[i].len;
+  }
+
+  /** Write, and carry on after partial writes **/
+  writeAll(STDOUT_FILENO, ab->iov, ab->nseg);
+
+  ab->len = 0;
+  ab->nseg = 0;
+  return total;
+}
 
 
 /******************************************************************************
@@ -240,28 +946,136 @@ void bufferFree(struct editorBuffer *ab) {
  * buffer to the terminal screen.
  */ 
 void displayScreen() {
+  long long t = traceNow();
   scroll();
-
-  /** Initialize the editing buffer **/
-  struct editorBuffer ab = ABUF_INIT; 
-  /** Hide the cursor and initialize position **/
-  bufferWrite(&ab, HIDE_CURSOR);
-  bufferWrite(&ab, HOME_CURSOR);
+  traceEnd(TRACE_SCROLL, t);
+
+  /** The editing buffer is reused across frames **/
+  struct editorBuffer *ab = &editorBuffer;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ab->allocs = 0;
+
+  /** Hide the cursor **/
+  bufferWrite(ab, HIDE_CURSOR);
+  /** Scroll what the terminal shows instead of redrawing it **/
+  scrollScreen(ab);
   /** Write the modified rows to the buffer and 
    * draw the screen with status/message bars **/
-  displayRows(&ab);
-  displayStatusBar(&ab);
-  displayMessageBar(&ab);
+  t = traceNow();
+  displayRows(ab);
+  traceEnd(TRACE_ROWS, t);
+  bufferMark mark = lineBegin(ab, E.screenrows);
+  displayStatusBar(ab);
+  lineEnd(ab, E.screenrows, mark);
+  mark = lineBegin(ab, E.screenrows + 1);
+  displayMessageBar(ab);
+  lineEnd(ab, E.screenrows + 1, mark);
 
   /**  Print the hidden cursor then show it **/
   char buf[32];
-  snprintf(buf, sizeof(buf), INIT_CURSOR);
-  bufferWrite(&ab, buf, strlen(buf));
-  bufferWrite(&ab, SHOW_CURSOR);
+  int cy = E.cy - E.rowoff, cx = E.rx - E.coloff;
+  if (E.softwrap) {
+    cy = visualPrefix(E.cy) + E.rx / E.screencols - E.rowoff;
+    cx = E.rx % E.screencols;
+  }
+  snprintf(buf, sizeof(buf), INIT_CURSOR(cy, cx));
+  bufferWrite(ab, buf, strlen(buf));
+  bufferWrite(ab, SHOW_CURSOR);
+  clock_gettime(CLOCK_MONOTONIC, &end);
   
-  /** Write the buffer to standard output and free buffer **/
-  write(STDOUT_FILENO, ab.b, ab.len);
-  bufferFree(&ab);
+  /** Write the buffer to standard output in one go **/
+  screen.segments = ab->nseg;
+  t = traceNow();
+  screen.bytes = bufferFlush(ab);
+  traceEnd(TRACE_WRITE, t);
+  screen.allocs = ab->allocs;
+  screen.buildns = (end.tv_sec - start.tv_sec) * 1000000000LL 
+    + (end.tv_nsec - start.tv_nsec);
+}
+
+/**
+ * Forgets what the terminal shows, hence the next frame
+ * redraws every line.
+ */ 
+void invalidateScreen() {
+  screen.lines = E.screenrows + 2;
+  screen.hash = realloc(screen.hash, sizeof(*screen.hash) * screen.lines);
+  memset(screen.hash, 0, sizeof(*screen.hash) * screen.lines);
+  screen.rowoff = E.rowoff;
+}
+
+/**
+ * If the window moved vertically by less than a screen,
+ * scrolls the text area of the terminal with a scroll region
+ * and shifts the line hashes along. Only the lines scrolled
+ * in are then drawn.
+ * @param editorBuffer is the editing buffer.
+ */ 
+void scrollScreen(struct editorBuffer *ab) {
+  if (screen.lines != E.screenrows + 2) invalidateScreen();
+  int d = E.rowoff - screen.rowoff;
+  screen.rowoff = E.rowoff;
+  if (d == 0) return;
+  if (d >= E.screenrows || -d >= E.screenrows) {
+    memset(screen.hash, 0, sizeof(*screen.hash) * E.screenrows);
+    return;
+  }
+
+  /** Limit scrolling to the text area, then scroll up (S)
+   * or down (T) and reset the region **/
+  char buf[32];
+  int n = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+    E.screenrows, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+  bufferWrite(ab, buf, n);
+
+  unsigned long long *h = screen.hash;
+  if (d > 0) {
+    memmove(h, h + d, sizeof(*h) * (E.screenrows - d));
+    memset(h + E.screenrows - d, 0, sizeof(*h) * d);
+  } else {
+    memmove(h - d, h, sizeof(*h) * (E.screenrows + d));
+    memset(h, 0, sizeof(*h) * -d);
+  }
+}
+
+/**
+ * Starts drawing a screen line by moving the cursor to it.
+ * @param editorBuffer is the editing buffer.
+ * @param y is the screen line.
+ * @return a mark to pass to lineEnd.
+ */ 
+bufferMark lineBegin(struct editorBuffer *ab, int y) {
+  bufferMark mark = bufferTell(ab);
+  char buf[16];
+  int n = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+  bufferWrite(ab, buf, n);
+  return mark;
+}
+
+/**
+ * Finishes drawing a screen line. If the terminal already
+ * shows the same line, it is dropped from the buffer.
+ * @param editorBuffer is the editing buffer.
+ * @param y is the screen line.
+ * @param mark is the mark returned by lineBegin.
+ */ 
+void lineEnd(struct editorBuffer *ab, int y, bufferMark mark) {
+  /** FNV-1a hash of the segments of the line **/
+  unsigned long long h = 14695981039346656037ULL;
+  const char *b = ab->b + mark.len;
+  for (int i = mark.nseg; i < ab->nseg; i++) {
+    const char *p = ab->seg[i].p ? ab->seg[i].p : b;
+    for (int j = 0; j < ab->seg[i].len; j++)
+      h = (h ^ (unsigned char) p[j]) * 1099511628211ULL;
+    if (ab->seg[i].p == NULL) b += ab->seg[i].len;
+  }
+  if (h == 0) h = 1;
+
+  if (screen.hash[y] == h)
+    bufferSeek(ab, mark);
+  else
+    screen.hash[y] = h;
 }
 
 /**
@@ -295,12 +1109,20 @@ void displayStatusBar(struct editorBuffer *ab) {
   /** Invert colors for the status bar **/
   bufferWrite(ab, "\x1b[7m", 4);
   /** Initialize space for status bar strings **/
-  char status[80];
+  char status[160];
   char rstatus[80];
 
   /** Display <name of file> -- <length of file> **/
+  const char *name = E.filename ? E.filename : "[No Name]";
+  if (logview.open) name = logview.title;
   int len = snprintf(status, sizeof(status), "[ %s - READ %d LINES ]",
-    E.filename ? E.filename : "[No Name]", E.numrows);
+    name, E.numrows);
+  if (buffers.n > 1 && len < (int) sizeof(status))
+    len += snprintf(status + len, sizeof(status) - len, " BUFFER %d/%d",
+      buffers.cur + 1, buffers.n);
+  if (E.traceoverlay) len = traceStatus(status, sizeof(status));
+  if (len >= (int) sizeof(status)) len = sizeof(status) - 1;
+  if (len > E.screencols) len = E.screencols;
 
   /** Display the current line the user is on **/
   int rlen = snprintf(rstatus, sizeof(rstatus), "LINE %d \t", E.cy + 1);
@@ -326,6 +1148,30 @@ void displayStatusBar(struct editorBuffer *ab) {
   bufferWrite(ab, "\x1b[m", 3); // turn off color inversion
 }
 
+/**
+ * Writes the p50/p99 latency of every traced stage, in
+ * microseconds, for the status bar.
+ * @param buf is where to write to, size its size.
+ * @return the length of the text.
+ */ 
+int traceStatus(char *buf, int size) {
+  static const char *label[TRACE_STAGES] = {
+    "read", "key", "scroll", "rows", "write", "frame"
+  };
+  int len = snprintf(buf, size, "p50/p99 us:");
+  for (int i = 0; i < TRACE_STAGES && len < size; i++)
+    len += snprintf(buf + len, size - len, " %s %lld/%lld", label[i],
+      tracePercentile(i, 0.5) / 1000, tracePercentile(i, 0.99) / 1000);
+  return len;
+}
+
+/**
+ * Turns the latency overlay of the status bar on or off.
+ */ 
+void toggleTrace() {
+  E.traceoverlay = !E.traceoverlay;
+}
+
 /**
  * Displays a message bar below the status bar. This
  * must be displayed only for 5 seconds.
@@ -337,8 +1183,8 @@ void displayMessageBar(struct editorBuffer *ab) {
   /** If message exceeds window length, don't display the 
    * extra characters **/
   if (msglen > E.screencols) msglen = E.screencols;
-  /** If message is less than 5 seconds old display it **/
-  if (time(NULL) - E.statusmsg_time < 5)
+  /** Display the message until it expires **/
+  if (monotonicMs() < E.statusmsg_time)
     bufferWrite(ab, E.statusmsg, msglen);
 }
 
@@ -353,7 +1199,9 @@ void setMessage(const char *fmt, ...) {
     va_start(ap,fmt);
     vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
     va_end(ap);
-    E.statusmsg_time = time(NULL);
+    E.statusmsg_time = monotonicMs() + MESSAGE_MS;
+    /** The timer wakes the editor up to clear it **/
+    armTimer(MESSAGE_MS);
 }
 
 /**
@@ -363,7 +1211,7 @@ void setMessage(const char *fmt, ...) {
  */ 
 void moveCursor(int key) {
     /** Check if current cursor is out of bounds **/
-    rows *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    bool row = E.cy < E.numrows;
 
     switch (key) {
     case ARROW_LEFT:
@@ -375,17 +1223,17 @@ void moveCursor(int key) {
           /** Circle back to end of last row if user 
            * presses out of screen **/
           E.cy--;
-          E.cx = E.row[E.cy].size;
+          E.cx = E.row.size[E.cy];
         }
         break;
     case ARROW_RIGHT:
       if (row) {
         /** If not out of bounds of the row*/
-        if (E.cx < row->size){
+        if (E.cx < E.row.size[E.cy]){
           /** If not out of bounds of editor window scope
            * move right **/
           E.cx++;
-        } else if (E.cx == row->size) {
+        } else if (E.cx == E.row.size[E.cy]) {
           /** If the cursor is at end of row, set cursor
            *  to beginning of next row **/
           E.cy++;
@@ -409,8 +1257,7 @@ void moveCursor(int key) {
   }
 
     /** Set row again, incase the cursor changes **/
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy]; 
-    int rowlen = row ? row->size : 0; // get length of row 
+    int rowlen = (E.cy < E.numrows) ? E.row.size[E.cy] : 0; // get length of row 
     /** if current position is past length of row don't
      *  display further **/
     if (E.cx > rowlen) 
@@ -418,6 +1265,30 @@ void moveCursor(int key) {
     
 }
 
+/**
+ * Moves the cursor over a word, crossing rows at
+ * their ends like the arrow keys.
+ * @param key is ARROW_LEFT or ARROW_RIGHT.
+ */ 
+void moveWord(int key) {
+  if (E.cy >= E.numrows) {
+    if (key == ARROW_LEFT) moveCursor(key);
+    return;
+  }
+  char *s = E.row.chars[E.cy];
+  int len = E.row.size[E.cy];
+
+  if (key == ARROW_RIGHT) {
+    if (E.cx == len) { moveCursor(key); return; }
+    while (E.cx < len && !isalnum((unsigned char) s[E.cx])) E.cx++;
+    while (E.cx < len && isalnum((unsigned char) s[E.cx])) E.cx++;
+  } else {
+    if (E.cx == 0) { moveCursor(key); return; }
+    while (E.cx > 0 && !isalnum((unsigned char) s[E.cx - 1])) E.cx--;
+    while (E.cx > 0 && isalnum((unsigned char) s[E.cx - 1])) E.cx--;
+  }
+}
+
 /**
  * Depending on the requested position of the cursor, 
  * simulates a scrolling movement.
@@ -425,15 +1296,16 @@ void moveCursor(int key) {
 void scroll() {
     /** Set the rendered cursor to its position **/
     E.rx = 0;
-    if (E.cy < E.numrows) {
-        for (int i = 0; i < E.cx; i++) {
-            if (E.row[E.cy].chars[i] == '\t')
-            /** If there is a tab encountered, set rx
-             * to next tab stop **/
-                E.rx += (TABS - 1) - (E.rx % TABS);
-            E.rx++; // moves cursor to next character
-        }
-    }
+    if (E.cy < E.numrows) E.rx = rowCxToRx(E.cy, E.cx);
+
+  if (E.softwrap) {
+    /** Keep the visual line of the cursor in the window **/
+    int vy = visualPrefix(E.cy) + E.rx / E.screencols;
+    if (vy < E.rowoff) E.rowoff = vy;
+    else if (vy >= E.rowoff + E.screenrows) E.rowoff = vy - E.screenrows + 1;
+    E.coloff = 0;
+    return;
+  }
 
   /** Scroll up **/
   if (E.cy < E.rowoff) {
@@ -457,6 +1329,206 @@ void scroll() {
 }
 
 
+/**
+ * Makes sure the row table can hold n rows. The arrays
+ * grow geometrically, hence appending rows is amortized O(1).
+ * @param n is the number of rows needed.
+ */
+void growRows(int n) {
+  growTable(&E.row, n);
+}
+
+/**
+ * Makes sure a table of rows can hold n rows.
+ * @param t is the table.
+ * @param n is the number of rows needed.
+ */
+void growTable(rows *t, int n) {
+  if (n <= t->cap) return;
+  int cap = t->cap ? t->cap : 64;
+  while (cap < n) cap *= 2;
+
+  /** Reallocate every array of the table **/
+  t->size = realloc(t->size, sizeof(int) * cap);
+  t->rsize = realloc(t->rsize, sizeof(int) * cap);
+  t->rstart = realloc(t->rstart, sizeof(int) * cap);
+  t->chars = realloc(t->chars, sizeof(char *) * cap);
+  t->render = realloc(t->render, sizeof(char *) * cap);
+  t->hl = realloc(t->hl, sizeof(unsigned char *) * cap);
+  t->ccap = realloc(t->ccap, sizeof(int) * cap);
+  t->rcap = realloc(t->rcap, sizeof(int) * cap);
+  t->flags = realloc(t->flags, cap);
+  t->tabs = realloc(t->tabs, sizeof(int *) * cap);
+  t->ntabs = realloc(t->ntabs, sizeof(int) * cap);
+  if (!t->size || !t->rsize || !t->chars || !t->render || !t->hl ||
+    !t->ccap || !t->rcap || !t->flags || !t->tabs || !t->ntabs || !t->rstart)
+    die("realloc");
+  t->cap = cap;
+}
+
+/**
+ * Moves a row from one table to a slot of another, its
+ * payload goes along.
+ * @param to, t are the table and slot moved to.
+ * @param from, f are the table and row moved.
+ */
+void moveRow(rows *to, int t, rows *from, int f) {
+  to->size[t] = from->size[f];
+  to->rsize[t] = from->rsize[f];
+  to->rstart[t] = from->rstart[f];
+  to->chars[t] = from->chars[f];
+  to->render[t] = from->render[f];
+  to->hl[t] = from->hl[f];
+  to->ccap[t] = from->ccap[f];
+  to->rcap[t] = from->rcap[f];
+  to->flags[t] = from->flags[f];
+  to->tabs[t] = from->tabs[f];
+  to->ntabs[t] = from->ntabs[f];
+}
+
+/**
+ * Frees the arrays of a table of rows, not the rows.
+ * @param t is the table.
+ */
+void freeTable(rows *t) {
+  free(t->size);
+  free(t->rsize);
+  free(t->rstart);
+  free(t->chars);
+  free(t->render);
+  free(t->hl);
+  free(t->ccap);
+  free(t->rcap);
+  free(t->flags);
+  free(t->tabs);
+  free(t->ntabs);
+  memset(t, 0, sizeof(*t));
+}
+
+/**
+ * Moves count rows of the table starting at from, to the
+ * index to. Every array is moved.
+ */
+void shiftRows(int to, int from, int count) {
+  /** Rows move, the wrap layout is built again **/
+  wrap.valid = false;
+  if (count <= 0 || to == from) return;
+  memmove(&E.row.size[to], &E.row.size[from], sizeof(int) * count);
+  memmove(&E.row.rsize[to], &E.row.rsize[from], sizeof(int) * count);
+  memmove(&E.row.rstart[to], &E.row.rstart[from], sizeof(int) * count);
+  memmove(&E.row.chars[to], &E.row.chars[from], sizeof(char *) * count);
+  memmove(&E.row.render[to], &E.row.render[from], sizeof(char *) * count);
+  memmove(&E.row.hl[to], &E.row.hl[from], sizeof(unsigned char *) * count);
+  memmove(&E.row.ccap[to], &E.row.ccap[from], sizeof(int) * count);
+  memmove(&E.row.rcap[to], &E.row.rcap[from], sizeof(int) * count);
+  memmove(&E.row.flags[to], &E.row.flags[from], count);
+  memmove(&E.row.tabs[to], &E.row.tabs[from], sizeof(int *) * count);
+  memmove(&E.row.ntabs[to], &E.row.ntabs[from], sizeof(int) * count);
+}
+
+/**
+ * Frees the payload of a row.
+ * @param at is the index of the row.
+ */
+void freeRow(int at) {
+  dropColumnMap(at);
+  poolFree(&pool, E.row.render[at], E.row.rcap[at]);
+  poolFree(&pool, E.row.hl[at], E.row.rcap[at]);
+  /** A save may still be writing the text **/
+  if (E.row.flags[at] & ROW_PINNED) deferFree(E.row.chars[at], E.row.ccap[at]);
+  else poolFree(&pool, E.row.chars[at], E.row.ccap[at]);
+}
+
+/**
+ * Frees the column map of a row, it is built again
+ * when next needed.
+ * @param at is the index of the row.
+ */
+void dropColumnMap(int at) {
+  if (E.row.ntabs[at] > 0)
+    poolFree(&pool, E.row.tabs[at], 
+      poolCapacity(sizeof(int) * 2 * E.row.ntabs[at]));
+  E.row.tabs[at] = NULL;
+  E.row.ntabs[at] = -1;
+}
+
+/**
+ * Returns the column map of a row, building it on first
+ * use. For every tab it holds the position of the tab in
+ * chars and the rendered column right after it; characters
+ * in between tabs are one column wide.
+ * @param at is the index of the row.
+ * @return pairs of position and column, ntabs of them.
+ */
+int *columnMap(int at) {
+  if (E.row.ntabs[at] >= 0) return E.row.tabs[at];
+
+  char *chars = E.row.chars[at];
+  int size = E.row.size[at];
+  int n = 0;
+  for (char *p = chars; (p = memchr(p, '\t', chars + size - p)); p++) n++;
+
+  int *map = NULL;
+  if (n > 0) {
+    map = poolAlloc(&pool, sizeof(int) * 2 * n);
+    int rx = 0, last = 0, k = 0;
+    for (char *p = chars; (p = memchr(p, '\t', chars + size - p)); p++) {
+      /** Characters up to the tab, then the tab to its stop **/
+      rx += (p - chars) - last;
+      rx += TABS - rx % TABS;
+      last = p - chars + 1;
+      map[2 * k] = p - chars;
+      map[2 * k + 1] = rx;
+      k++;
+    }
+  }
+  E.row.tabs[at] = map;
+  E.row.ntabs[at] = n;
+  return map;
+}
+
+/**
+ * Given a position in a row, returns the position it
+ * is rendered at. The column map is searched for the last
+ * tab before it, in O(log n) of the tabs.
+ * @param at is the index of the row.
+ * @param cx is the position in chars.
+ */ 
+int rowCxToRx(int at, int cx) {
+  int *map = columnMap(at);
+  /** Number of tabs before cx **/
+  int lo = 0, hi = E.row.ntabs[at];
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (map[2 * mid] < cx) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0) return cx;
+  return map[2 * lo - 1] + cx - map[2 * lo - 2] - 1;
+}
+
+/**
+ * Given a rendered position in a row, returns the position
+ * in chars it shows. Columns inside a tab map to the tab.
+ * @param at is the index of the row.
+ * @param rx is the rendered position.
+ */ 
+int rowRxToCx(int at, int rx) {
+  int *map = columnMap(at);
+  int n = E.row.ntabs[at];
+  /** Number of tabs that end at or before rx **/
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (map[2 * mid + 1] <= rx) lo = mid + 1;
+    else hi = mid;
+  }
+  int cx = lo == 0 ? rx : map[2 * lo - 2] + 1 + rx - map[2 * lo - 1];
+  if (lo < n && cx > map[2 * lo]) cx = map[2 * lo];
+  if (cx > E.row.size[at]) cx = E.row.size[at];
+  return cx;
+}
+
 /**
  * For every line being read of a file, at loadFile, writeRow
  * writes them to the rows structure. Then, makes a call to
@@ -467,105 +1539,374 @@ void scroll() {
  */
 void writeRow(int index, char *line, size_t len) {
   if (index < 0 || index > E.numrows) return;
-  /** Extend size of the rows string array by 1 for every
-   *  row read **/
-  E.row = realloc(E.row, sizeof(rows) * (E.numrows + 1));
-  memmove(&E.row[index + 1], &E.row[index], sizeof(rows) 
-    * (E.numrows - index));
-
-  /** Fill in the row structure for the current row in file **/
-  E.row[index].size = len; 
-  E.row[index].chars = malloc(len + 1); 
-  memcpy(E.row[index].chars, line, len); 
-
-  /** Initialize rsize and render and then make a call to
-   *  render the currently read line **/
-  E.row[index].rsize = 0;
-  E.row[index].render = NULL;
-  E.row[index].hl = NORMAL;
-  renderRow(&E.row[index]);
+  /** Make room for one more row and move the
+   *  following rows down by 1 **/
+  growRows(E.numrows + 1);
+  shiftRows(index + 1, index, E.numrows - index);
+  fillRow(index, line, len);
 
   /** Keep a record of the number of lines read, display
    *  on status bar **/
   E.numrows++;
-  E.modified = true;
+  setModified();
 }
 
 /**
- * Given a row from the array of rows, renders the row data
- * to be displayed with consistent tabs on the terminal screen.
- * @param row is a row from the rows structure array
+ * Fills in a free slot of the row table with a line,
+ * and renders it.
+ * @param at is the index of the slot.
+ * @param line is the text, len its length.
  */ 
-void renderRow(rows *row) {
-  int tabs = 0;
-  /** count number of tabs in the row string **/
-  for (int i = 0; i < row->size; i++)
-    if (row->chars[i] == '\t') tabs++;
+void fillRow(int at, const char *line, size_t len) {
+  /** Fill in the row table for the current row in file **/
+  E.row.size[at] = len; 
+  E.row.chars[at] = poolAlloc(&pool, len + 1); 
+  E.row.ccap[at] = poolCapacity(len + 1);
+  memcpy(E.row.chars[at], line, len); 
+  E.row.chars[at][len] = '\0';
 
-  free(row->render);
-  /** allocate memory to rendered row with size of text + 8 
-   * characters for each tab in row**/
-  row->render = malloc(row->size + 1 + tabs*(TABS - 1));
+  /** Initialize rsize and render and then make a call to
+   *  render the currently read line **/
+  E.row.rsize[at] = 0;
+  E.row.render[at] = NULL;
+  E.row.hl[at] = NULL;
+  E.row.rcap[at] = 0;
+  E.row.flags[at] = 0;
+  E.row.tabs[at] = NULL;
+  E.row.ntabs[at] = -1;
+  renderRow(at);
+}
 
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      /** append space if there is a tab encountered, until
+/**
+ * Given a row from the table of rows, renders the row data
+ * to be displayed with consistent tabs on the terminal screen.
+ * @param at is the index of the row in the table
+ */ 
+void renderRow(int at) {
+  /** The text changed, the column map is stale **/
+  dropColumnMap(at);
+  if (E.deferrender) {
+    E.row.flags[at] |= ROW_STALE;
+    return;
+  }
+  E.row.flags[at] &= ~ROW_STALE;
+  if (E.row.size[at] > LONG_LINE) {
+    /** Long rows are only rendered around the window **/
+    renderSlice(at, E.coloff);
+    return;
+  }
+  E.row.flags[at] &= ~ROW_SLICED;
+  E.row.rstart[at] = 0;
+
+  char *chars = E.row.chars[at];
+  int size = E.row.size[at];
+  int tabs = 0;
+  /** count number of tabs in the row string **/
+  for (int i = 0; i < size; i++)
+    if (chars[i] == '\t') tabs++;
+
+  /** allocate memory to rendered row with size of text + 8 
+   * characters for each tab in row, the highlighting field
+   * gets the same capacity. Only grow when it doesn't fit **/
+  int need = size + 1 + tabs*(TABS - 1);
+  if (need > E.row.rcap[at]) {
+    poolFree(&pool, E.row.render[at], E.row.rcap[at]);
+    poolFree(&pool, E.row.hl[at], E.row.rcap[at]);
+    E.row.render[at] = poolAlloc(&pool, need);
+    E.row.hl[at] = poolAlloc(&pool, need);
+    E.row.rcap[at] = poolCapacity(need);
+  }
+
+  char *render = E.row.render[at];
+  int idx = 0;
+  for (int j = 0; j < size; j++) {
+    if (chars[j] == '\t') {
+      /** append space if there is a tab encountered, until
        *  a tab stop, which is 8 characters later **/
-      row->render[idx++] = ' ';
-      while (idx % TABS != 0) row->render[idx++] = ' ';
+      render[idx++] = ' ';
+      while (idx % TABS != 0) render[idx++] = ' ';
     } else {
-      row->render[idx++] = row->chars[j];
+      render[idx++] = chars[j];
     }
   }
   /** set the null character and size of the rendered row **/
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  render[idx] = '\0';
+  E.row.rsize[at] = idx;
+
+  highlightWords(at);
+}
+
+/**
+ * Renders the part of a long row around a rendered column,
+ * LONG_MARGIN columns before it and up to LONG_SLICE columns
+ * in total. The column map locates the first byte, hence an
+ * edit doesn't expand the whole row again.
+ * @param at is the index of the row in the table.
+ * @param col is the first rendered column on the screen.
+ */ 
+void renderSlice(int at, int col) {
+  char *chars = E.row.chars[at];
+  int size = E.row.size[at];
+  E.row.rsize[at] = rowCxToRx(at, size);
+  int start = col > LONG_MARGIN ? col - LONG_MARGIN : 0;
+  E.row.rstart[at] = start;
+  E.row.flags[at] |= ROW_SLICED;
+
+  int need = LONG_SLICE + 1;
+  if (need > E.row.rcap[at]) {
+    poolFree(&pool, E.row.render[at], E.row.rcap[at]);
+    poolFree(&pool, E.row.hl[at], E.row.rcap[at]);
+    E.row.render[at] = poolAlloc(&pool, need);
+    E.row.hl[at] = poolAlloc(&pool, need);
+    E.row.rcap[at] = poolCapacity(need);
+  }
+
+  /** The slice may start in the middle of a tab **/
+  char *render = E.row.render[at];
+  int cx = rowRxToCx(at, start);
+  int rx = rowCxToRx(at, cx);
+  int idx = 0;
+  for (; cx < size && idx < LONG_SLICE; cx++) {
+    if (chars[cx] == '\t') {
+      int stop = rx + TABS - rx % TABS;
+      for (; rx < stop && idx < LONG_SLICE; rx++)
+        if (rx >= start) render[idx++] = ' ';
+    } else {
+      render[idx++] = chars[cx];
+      rx++;
+    }
+  }
+  render[idx] = '\0';
+
+  highlightWords(at);
+}
+
+/**
+ * Returns the number of rendered columns a row holds,
+ * starting at its rstart.
+ * @param at is the index of the row in the table.
+ */ 
+int renderedLength(int at) {
+  return tableRenderedLength(&E.row, at);
+}
+
+/**
+ * Returns the number of rendered columns a row of any table
+ * holds, a hidden buffer's included.
+ * @param t is the table, at the index of the row in it.
+ */ 
+int tableRenderedLength(rows *t, int at) {
+  if (!(t->flags[at] & ROW_SLICED)) return t->rsize[at];
+  int len = t->rsize[at] - t->rstart[at];
+  return len < LONG_SLICE ? len : LONG_SLICE;
+}
+
+/**
+ * Called after the text of a row was edited in place.
+ * Renders an edited row again.
+ * @param at is the index of the edited row
+ */
+void updateRow(int at) {
+  renderRow(at);
+  wrapUpdate(at);
+}
+
+/**
+ * Returns the number of visual lines a row takes in
+ * soft-wrap mode. There is always room for the cursor
+ * after the last column.
+ * @param at is the index of the row.
+ */ 
+int rowVisualLines(int at) {
+  return E.row.rsize[at] / E.screencols + 1;
+}
+
+/**
+ * Lays out every row for soft-wrap mode, if rows were
+ * added or removed or the window width changed since the
+ * last time. The Fenwick tree is built in O(n).
+ */ 
+void wrapBuild() {
+  if (wrap.valid && wrap.n == E.numrows && wrap.width == E.screencols)
+    return;
+  if (E.numrows + 1 > wrap.cap) {
+    wrap.cap = E.numrows + 1;
+    wrap.count = realloc(wrap.count, sizeof(int) * wrap.cap);
+    wrap.tree = realloc(wrap.tree, sizeof(int) * (wrap.cap + 1));
+    if (!wrap.count || !wrap.tree) die("realloc");
+  }
+  int n = E.numrows;
+  for (int i = 0; i < n; i++) {
+    wrap.count[i] = rowVisualLines(i);
+    wrap.tree[i + 1] = wrap.count[i];
+  }
+  /** Every node adds itself to its parent **/
+  for (int i = 1; i <= n; i++) {
+    int parent = i + (i & -i);
+    if (parent <= n) wrap.tree[parent] += wrap.tree[i];
+  }
+  wrap.n = n;
+  wrap.width = E.screencols;
+  wrap.valid = true;
+}
+
+/**
+ * Updates the visual lines of an edited row in the
+ * layout, in O(log n).
+ * @param at is the index of the row.
+ */ 
+void wrapUpdate(int at) {
+  if (!wrap.valid || wrap.n != E.numrows || at >= wrap.n) return;
+  int d = rowVisualLines(at) - wrap.count[at];
+  if (d == 0) return;
+  wrap.count[at] += d;
+  for (int i = at + 1; i <= wrap.n; i += i & -i) wrap.tree[i] += d;
+}
+
+/**
+ * Returns the number of visual lines before a row.
+ * @param at is the index of the row, up to numrows.
+ */ 
+int visualPrefix(int at) {
+  wrapBuild();
+  int v = 0;
+  for (int i = at; i > 0; i -= i & -i) v += wrap.tree[i];
+  return v;
+}
+
+/**
+ * Finds the row a visual line belongs to, by descending
+ * the Fenwick tree.
+ * @param v is the visual line.
+ * @param sub is set to the visual line within the row.
+ * @return the index of the row, numrows if past the end.
+ */ 
+int visualRow(int v, int *sub) {
+  wrapBuild();
+  int at = 0;
+  int step = 1;
+  while (step * 2 <= wrap.n) step *= 2;
+  for (; step > 0; step /= 2) {
+    if (at + step <= wrap.n && wrap.tree[at + step] <= v) {
+      at += step;
+      v -= wrap.tree[at];
+    }
+  }
+  *sub = v;
+  return at;
+}
+
+/**
+ * Writes part of a rendered row to the editing buffer.
+ * @param editorBuffer the editing buffer
+ * @param at is the index of the row.
+ * @param col is the first rendered column to write.
+ * @param from, to are the selected rendered columns.
+ */ 
+void drawRow(struct editorBuffer *ab, int at, int col, int from, int to) {
+  /** A long row is rendered again once the window
+   *  leaves its slice **/
+  int start = E.row.rstart[at];
+  if ((E.row.flags[at] & ROW_SLICED) && (col < start || 
+    (col + E.screencols > start + LONG_SLICE && 
+    start + LONG_SLICE < E.row.rsize[at]))) {
+    renderSlice(at, col);
+    start = E.row.rstart[at];
+  }
 
-  highlightWords(row);
+  int len;
+  /** If user tries to display past end of line, display nothing **/
+  if ((len = renderedLength(at) - (col - start)) < 0) len = 0;
+  /** if user tries to display out of window scope, display last
+   * possible line and don't go out of scope **/
+  if (len > E.screencols) len = E.screencols;
+  /** append rendered row to buffer to be displayed **/
+  char *c = &E.row.render[at][col - start];
+  unsigned char *hl = &E.row.hl[at][col - start];
+  from -= col;
+  if (to != INT_MAX) to -= col;
+
+  /** Walk the row as runs of the same attribute, the
+   * attribute is only changed at the start of a run. Every
+   * line starts and ends with normal attributes **/
+  bool inverted = false;
+  int j = 0;
+  while (j < len) {
+    bool inv = hl[j] != NORMAL || (j >= from && j < to);
+    int k = j + 1;
+    while (k < len && (hl[k] != NORMAL || (k >= from && k < to)) == inv)
+      k++;
+    if (inv != inverted) {
+      if (inv) bufferWrite(ab, "\x1b[7m", 4);
+      else bufferWrite(ab, "\x1b[m", 3);
+      inverted = inv;
+    }
+    bufferRef(ab, &c[j], k - j); // the whole run, without a copy
+    j = k;
+  }
+  if (inverted) bufferWrite(ab, "\x1b[m", 3);
 }
 
 /**
  * Writes the rendered rows to the editing buffer to be displayed
- * on the terminal screen.
+ * on the terminal screen. In soft-wrap mode every screen line
+ * shows the next window wide piece of a row.
  * @param editorBuffer the editing buffer
  */ 
 void displayRows(struct editorBuffer *ab) {
-    /** Iterate through all the window screen rows **/
+  /** Rendered range of the selection, if any **/
+  int sy1, sx1, sy2, sx2;
+  bool selection = getSelection(&sy1, &sx1, &sy2, &sx2);
+  if (selection) {
+    sx1 = rowCxToRx(sy1, sx1);
+    sx2 = rowCxToRx(sy2, sx2);
+  }
+
+  /** The row and visual line shown at the top **/
+  int filerow = E.rowoff, sub = 0;
+  if (E.softwrap) filerow = visualRow(E.rowoff, &sub);
+
+  /** Iterate through all the window screen rows **/
   for (int y = 0; y < E.screenrows; y++) {
-    /** index of line to be displayed on screen, takes into account
-     *  moving out of visible editor window **/
-    int filerow = y + E.rowoff; 
+    bufferMark mark = lineBegin(ab, y);
 
     if (filerow < E.numrows) {
-      /** Make sure current row is not past the total number of 
-       * rows in file **/
-      int len;
-      /** If user tries to display past end of line, display nothing **/
-      if ((len = E.row[filerow].rsize - E.coloff) < 0) len = 0;
-      /** if user tries to display out of window scope, display last
-       * possible line and don't go out of scope **/
-      if (len > E.screencols) len = E.screencols;
-      /** append rendered row to buffer to be displayed **/
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      for (int j = 0; j < len; j++) {
-         if (hl[j] == NORMAL) {
-          bufferWrite(ab, "\x1b[m", 3);
-          bufferWrite(ab, &c[j], 1);
-        } else {
-          bufferWrite(ab, "\x1b[7m", 4);
-          bufferWrite(ab, &c[j], 1);
-        }
+      /** Selected columns of this row are inverted too **/
+      int from = INT_MAX, to = INT_MAX;
+      if (selection && filerow >= sy1 && filerow <= sy2) {
+        from = filerow == sy1 ? sx1 : 0;
+        to = filerow == sy2 ? sx2 : INT_MAX;
       }
-      bufferWrite(ab, "\x1b[m", 3);
+      int col = E.softwrap ? sub * E.screencols : E.coloff;
+      drawRow(ab, filerow, col, from, to);
     }
 
     bufferWrite(ab, ERASE_IN_LINE);
-    bufferWrite(ab, "\r\n", 2); // append a return and end of line
+    lineEnd(ab, y, mark); // drop the line if it didn't change
+
+    /** index of the next line to be displayed, a wrapped
+     *  row continues on the next screen line **/
+    if (E.softwrap && filerow < E.numrows && ++sub < rowVisualLines(filerow))
+      continue;
+    filerow++;
+    sub = 0;
   }
 }
 
+/**
+ * Turns soft-wrap mode on or off, keeping the top row
+ * of the window in place.
+ */ 
+void toggleWrap() {
+  int sub;
+  if (E.softwrap) E.rowoff = visualRow(E.rowoff, &sub);
+  else E.rowoff = visualPrefix(E.rowoff);
+  E.softwrap = !E.softwrap;
+  E.coloff = 0;
+  invalidateScreen();
+  setMessage(E.softwrap ? "Soft wrap on." : "Soft wrap off.");
+}
+
 
 /******************************************************************************
 *                          Editing/Control                                    *
@@ -575,23 +1916,29 @@ void displayRows(struct editorBuffer *ab) {
  * Given a row in the rows array, insert the character
  * in a specific position in this row.
  * This position is indicated by the user's cursor.
+ * @param at is the index of the row to be inserted into.
  * @param c the character to be inserted.
- * @param row is the row to be inserted into.
  */ 
-void insertCharToRow(rows *row, int c) {
+void insertCharToRow(int at, int c) {
+  unpinRow(at);
+  int size = E.row.size[at];
   /** Check if the cursor is out of bounds **/
-	if (E.cx < 0 || E.cx > row->size) E.cx = row->size;
-  /** Reallocate memory to rows, 2 bytes for the new
-   * character and the null byte **/
-	row->chars = realloc(row->chars, row->size + 2);
+	if (E.cx < 0 || E.cx > size) E.cx = size;
+  /** Reallocate memory to rows if it is full, 2 bytes for 
+   * the new character and the null byte **/
+  if (size + 2 > E.row.ccap[at]) {
+    E.row.chars[at] = poolRealloc(&pool, E.row.chars[at], E.row.ccap[at], size + 2);
+    E.row.ccap[at] = poolCapacity(size + 2);
+  }
 
   /** Move the data to the cursor's right by 1 **/
-  memmove(&row->chars[E.cx + 1], &row->chars[E.cx], row->size - E.cx + 1);
+  char *chars = E.row.chars[at];
+  memmove(&chars[E.cx + 1], &chars[E.cx], size - E.cx + 1);
   /** Insert the character in the cursor's position
    * and render the row **/
-  row->chars[E.cx] = c;
-  row->size++;
-  renderRow(row);
+  chars[E.cx] = c;
+  E.row.size[at]++;
+  updateRow(at);
   E.cx++; /** move cursor to the right hence next insert
    won’t overwrite **/
 }
@@ -604,12 +1951,20 @@ void insertCharToRow(rows *row, int c) {
 void insertChar(int c) {
   /** Set modified to true hence, the user must
    * be prompted to save the buffer before quitting **/
-  E.modified = true;
-	if (E.cy == E.numrows)
+  setModified();
+  int flags = 0;
+	if (E.cy == E.numrows) {
     /** If the user inserts a character to a
      * newline, add a newline to rows **/
 		writeRow(E.numrows, "",0);
-	insertCharToRow(&E.row[E.cy], c); // insert character to rows
+    recordOp(OP_ADDROW, E.cy, 0, "", 0, 0);
+    flags = OP_CHAIN;
+  }
+	insertCharToRow(E.cy, c); // insert character to rows
+
+  /** Record the insert, after it is clamped to the row **/
+  char ch = c;
+  recordInsert(E.cy, E.cx - 1, &ch, 1, flags);
 }
 
 /** Insert a newline depending on the position of
@@ -619,19 +1974,20 @@ void insertNewline() {
   if (E.cx == 0) {
     /** At the head of a row **/
     writeRow(E.cy, "", 0); // insert a new row
+    recordOp(OP_ADDROW, E.cy, 0, "", 0, 0);
   } else {
+    recordInsert(E.cy, E.cx, "\n", 1, 0);
     /** Anywhere else within a row **/
-    rows *row = &E.row[E.cy]; // get the row structure
+    unpinRow(E.cy);
 
     /** Write the contents of the current row
      * to one row down, starting from current position
      * of cursor **/
-    writeRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    writeRow(E.cy + 1, &E.row.chars[E.cy][E.cx], E.row.size[E.cy] - E.cx);
     /** Update the current row and render it**/
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    renderRow(row);
+    E.row.size[E.cy] = E.cx;
+    E.row.chars[E.cy][E.cx] = '\0';
+    updateRow(E.cy);
   }
   /** Move the cursor to the head of the bottom row **/
   E.cy++;
@@ -649,34 +2005,128 @@ void appendLine(char *filename, char *s) {
   FILE *fp = fopen(filename,"a");
   if (fp==NULL) die("fopen failed");
 
-  /** Append the string and close **/
+  /** Append the string under the lock of appendStream
+   *  and close **/
+  flock(fileno(fp), LOCK_EX);
   fprintf(fp, "%s\n", s);
+  fflush(fp);
+  flock(fileno(fp), LOCK_UN);
   fclose(fp);
   char message[80] =  "Operation successful.\r\n";
   write(STDOUT_FILENO, message, strlen(message));
 }
 
 
+/**
+ * Appends the lines read from stdin to a file, for
+ * --append <file> -. Whole lines are written in batches of
+ * up to APPEND_BUFFER bytes, each under an exclusive flock,
+ * hence concurrent appenders never split each other's lines.
+ * A last line without a newline gets one.
+ * @param filename is the file to be appended to.
+ * @return the exit status.
+ */ 
+int appendStream(char *filename) {
+  int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror(filename);
+    return 1;
+  }
+
+  int cap = APPEND_BUFFER, len = 0, status = 0;
+  char *buf = malloc(cap);
+  if (buf == NULL) {
+    perror("malloc");
+    close(fd);
+    return 1;
+  }
+  long long lines = 0, bytes = 0;
+  long long start = traceNow();
+  bool eof = false;
+  while (!eof || len > 0) {
+    if (!eof) {
+      /** A line longer than the buffer grows it **/
+      if (len == cap) {
+        char *grown = realloc(buf, cap * 2);
+        if (grown == NULL) {
+          perror("realloc");
+          status = 1;
+          break;
+        }
+        buf = grown;
+        cap *= 2;
+      }
+      ssize_t n = read(STDIN_FILENO, buf + len, cap - len);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1) {
+        perror("read");
+        status = 1;
+        break;
+      }
+      if (n == 0) eof = true;
+      len += n;
+      /** Fill the buffer before writing, unless input is idle **/
+      if (n > 0 && len < cap) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, 0) == 1) continue;
+      }
+    }
+
+    /** Write up to the last newline, keep the rest **/
+    char *end = memrchr(buf, '\n', len);
+    if (eof && end == NULL && len > 0) {
+      buf[len++] = '\n';   // len < cap, the read came short
+      end = buf + len - 1;
+    }
+    if (end == NULL) continue;
+    int batch = end - buf + 1;
+    for (char *p = buf; (p = memchr(p, '\n', end + 1 - p)) != NULL; p++)
+      lines++;
+
+    struct iovec iov = {buf, batch};
+    flock(fd, LOCK_EX);
+    int err = writeAll(fd, &iov, 1);
+    flock(fd, LOCK_UN);
+    if (err == -1) {
+      perror(filename);
+      status = 1;
+      break;
+    }
+    bytes += batch;
+    memmove(buf, buf + batch, len - batch);
+    len -= batch;
+  }
+  free(buf);
+  close(fd);
+  if (status) return status;
+
+  double secs = (traceNow() - start) / 1e9;
+  printf("%lld lines, %lld bytes in %.3f s, %.0f lines/s\n", lines, bytes,
+    secs, secs > 0 ? lines / secs : 0);
+  return 0;
+}
+
 /**
  * Given a row delete a specific character that
  * the cursor is pointing to.
- * @param row is the row to be deleted from.
+ * @param at is the index of the row to be deleted from.
  */ 
-void deleteCharinRow(rows *row) {
+void deleteCharinRow(int at) {
   /** Check whether the cursor is out of bounds **/
-  if (E.cx-1 < 0 || E.cx-1 >= row->size) return;
+  if (E.cx-1 < 0 || E.cx-1 >= E.row.size[at]) return;
+  unpinRow(at);
 
   /** Overlap the text to the right of the cursor
    * with the current position in order to overwrite
    * the byte to be deleted. **/
-  memmove(&row->chars[E.cx - 1], &row->chars[E.cx],
-    row->size - (E.cx - 1));
+  memmove(&E.row.chars[at][E.cx - 1], &E.row.chars[at][E.cx],
+    E.row.size[at] - (E.cx - 1));
 
-  /** Update the row structure, and render **/
-  row->size--;
-  renderRow(row);
+  /** Update the row table, and render **/
+  E.row.size[at]--;
+  updateRow(at);
   E.cx--; // move the cursor up
-  E.modified = true;
+  setModified();
 }
 
 
@@ -685,20 +2135,25 @@ void deleteCharinRow(rows *row) {
  * to the current row.
  */ 
 void moveUp() {
-  /** Check if cursor is out of bounds **/
-  if (E.cy < 0 || E.cy >= E.numrows) return;
+  removeRow(E.cy);
+}
 
-  /** Get current row **/
-  rows *row = &E.row[E.cy];
+/**
+ * Removes a row from the table, the rows below
+ * move up by 1.
+ * @param at is the index of the row.
+ */ 
+void removeRow(int at) {
+  /** Check if the row is out of bounds **/
+  if (at < 0 || at >= E.numrows) return;
 
-  /** free the current row **/
-  free(row->render); 
-  free(row->chars);
+  /** free the row **/
+  freeRow(at);
 
   /** Move the rows below up by 1 **/
-  memmove(&E.row[E.cy], &E.row[E.cy + 1],
-    sizeof(rows) * (E.numrows - E.cy - 1)); 
+  shiftRows(at, at + 1, E.numrows - at - 1);
   E.numrows--; 
+  setModified();
 }
 
 
@@ -706,26 +2161,31 @@ void moveUp() {
  * When the user deletes at the head of a row, move
  * the contents of the current row up to the previous one.
  * The move all following rows up by 1.
- * @param row is the previous row.
+ * @param at is the index of the previous row.
  * @param s is the contents of the current row.
  * @param len is the size of s.
  */ 
-void deleteMoveUp(rows *row, char *s, size_t len) {
+void deleteMoveUp(int at, char *s, size_t len) {
+  unpinRow(at);
+  int size = E.row.size[at];
   /** Set the cursor the end of the previous line **/
-  E.cx = E.row[E.cy-1].size;
+  E.cx = size;
 
   /** Reallocate memory for the previous row to include
    *  the characters being appended from current row **/
-  row->chars = realloc(row->chars, row->size + len + 1);
+  if (size + (int) len + 1 > E.row.ccap[at]) {
+    E.row.chars[at] = poolRealloc(&pool, E.row.chars[at], E.row.ccap[at], size + len + 1);
+    E.row.ccap[at] = poolCapacity(size + len + 1);
+  }
 
   /** Copy the characters in the current row to the end
    *  of the previous row **/
-  memcpy(&row->chars[row->size], s, len);
+  memcpy(&E.row.chars[at][size], s, len);
 
   /** Update the current row and render it **/
-  row->size += len;
-  row->chars[row->size] = '\0';
-  renderRow(row);
+  E.row.size[at] += len;
+  E.row.chars[at][E.row.size[at]] = '\0';
+  updateRow(at);
 
   /** Move all the following rows up by 1 **/
   moveUp();
@@ -740,16 +2200,17 @@ void deleteChar() {
   if ( (E.cy == E.numrows) || (E.cx == 0 && E.cy == 0) )
     return;
 
-  /** Get current row **/
-  rows *row = &E.row[E.cy];
   if ( E.cx > 0 ) {
     /** If the cursor is in the middle of some 
      * row just delete the character**/
-    deleteCharinRow(row);
+    char c = E.row.chars[E.cy][E.cx - 1];
+    deleteCharinRow(E.cy);
+    recordOp(OP_DELETE, E.cy, E.cx, &c, 1, 0);
   } else {
     /** If the cursor is trying to delete at the
      * head of a row, move the row up **/
-    deleteMoveUp(&E.row[E.cy - 1], row->chars, row->size);
+    recordOp(OP_DELETE, E.cy - 1, E.row.size[E.cy - 1], "\n", 1, 0);
+    deleteMoveUp(E.cy - 1, E.row.chars[E.cy], E.row.size[E.cy]);
   }
 }
 
@@ -758,309 +2219,2094 @@ void deleteChar() {
  * entirely when the user presses CTRL-K.
  */ 
 void deleteLine() {
-  /** Get current row **/
-  rows *row = &E.row[E.cy];
+  if (E.cy >= E.numrows) return;
+  recordOp(OP_DELROW, E.cy, 0, E.row.chars[E.cy], E.row.size[E.cy], 0);
 
-  /** Set the cursor to the size of the row and call
-   *  deleteCharInRow until the entire row is deleted **/
-  E.cx = row->size;
-  while(row->size>0 && E.cy<E.numrows) deleteCharinRow(row);
-  /** Move up all following rows **/
-  if (E.cy<E.numrows) {
-    moveUp();
-  }
+  /** Remove the row, all following rows move up **/
+  removeRow(E.cy);
+  E.cx = 0;
 }
 
 
-/******************************************************************************
-*                                 File I/O                                    *
-******************************************************************************/
+/**
+ * Inserts bytes into a row at a given position.
+ * @param at is the index of the row.
+ * @param x is the position in the row.
+ * @param s is the text to insert, len its length.
+ */ 
+void rowInsert(int at, int x, const char *s, int len) {
+  unpinRow(at);
+  int size = E.row.size[at];
+  if (size + len + 1 > E.row.ccap[at]) {
+    E.row.chars[at] = poolRealloc(&pool, E.row.chars[at], E.row.ccap[at], size + len + 1);
+    E.row.ccap[at] = poolCapacity(size + len + 1);
+  }
+  /** Move the data right of x, with the null byte **/
+  memmove(&E.row.chars[at][x + len], &E.row.chars[at][x], size - x + 1);
+  memcpy(&E.row.chars[at][x], s, len);
+  E.row.size[at] += len;
+  updateRow(at);
+}
 
 /**
- * Given a filename, loads the file contents to row structures.
- * The row structures are then displayed on the editing buffer.
- * @param filename, name of the file to be loaded to display
+ * Deletes bytes from a row at a given position.
+ * @param at is the index of the row.
+ * @param x is the position in the row.
+ * @param len is the number of bytes to delete.
  */ 
-void loadFile(char *filename) {
-  /**   Set the filename globally **/
-  free(E.filename);
-  E.filename = strdup(filename);
+void rowDelete(int at, int x, int len) {
+  unpinRow(at);
+  memmove(&E.row.chars[at][x], &E.row.chars[at][x + len],
+    E.row.size[at] - x - len + 1);
+  E.row.size[at] -= len;
+  updateRow(at);
+}
 
-  /** Open given file to read it **/
-  FILE *fp = fopen(filename, "r"); 
-  if (!fp) return;
+/**
+ * Inserts text at a position of the buffer in a single
+ * pass. Newlines in the text split the row, the new rows
+ * are made room for with one shift of the row table.
+ * @param y, x is the position to insert at.
+ * @param s is the text, len its length.
+ * @param ey, ex are set to the position after the text.
+ */ 
+void insertText(int y, int x, const char *s, int len, int *ey, int *ex) {
+  if (y == E.numrows) writeRow(y, "", 0);
+  unpinRow(y);
+
+  /** Count the lines of the text **/
+  int lines = 0;
+  const char *p = s, *end = s + len, *nl;
+  while ((nl = memchr(p, '\n', end - p)) != NULL) {
+    lines++;
+    p = nl + 1;
+  }
+  if (lines == 0) {
+    rowInsert(y, x, s, len);
+    *ey = y;
+    *ex = x + len;
+    return;
+  }
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+  /** Make room for the new rows below y at once **/
+  growRows(E.numrows + lines);
+  shiftRows(y + 1 + lines, y + 1, E.numrows - y - 1);
+  E.numrows += lines;
+
+  /** The last new row takes the last line of the text
+   *  followed by the tail of row y **/
+  char *tail = &E.row.chars[y][x];
+  int taillen = E.row.size[y] - x;
+  int last = y + lines;
+  int lastlen = end - p;
+  E.row.size[last] = lastlen + taillen;
+  E.row.ccap[last] = poolCapacity(lastlen + taillen + 1);
+  E.row.chars[last] = poolAlloc(&pool, lastlen + taillen + 1);
+  memcpy(E.row.chars[last], p, lastlen);
+  memcpy(E.row.chars[last] + lastlen, tail, taillen);
+  E.row.chars[last][lastlen + taillen] = '\0';
+
+  /** Every full line in between becomes a row **/
+  p = memchr(s, '\n', len) + 1;
+  for (int at = y + 1; at < last; at++) {
+    nl = memchr(p, '\n', end - p);
+    E.row.size[at] = nl - p;
+    E.row.ccap[at] = poolCapacity(nl - p + 1);
+    E.row.chars[at] = poolAlloc(&pool, nl - p + 1);
+    memcpy(E.row.chars[at], p, nl - p);
+    E.row.chars[at][nl - p] = '\0';
+    p = nl + 1;
+  }
 
-  /** Until the end of the file, read each line and append to
-   *  rows **/
-  while ( (linelen = getline(&line, &linecap, fp)) != -1 ) {
-  /** Remove empty lines in between read lines **/
-  if (linelen > 0 && (line[linelen - 1] == '\n' 
-    || line[linelen - 1] == '\r'))
-      linelen--;
-  writeRow(E.numrows, line, linelen);
+  /** Render the new rows once each **/
+  for (int at = y + 1; at <= last; at++) {
+    E.row.rsize[at] = 0;
+    E.row.render[at] = NULL;
+    E.row.hl[at] = NULL;
+    E.row.rcap[at] = 0;
+    E.row.flags[at] = 0;
+    E.row.tabs[at] = NULL;
+    E.row.ntabs[at] = -1;
+    renderRow(at);
   }
 
-  /** Clean up **/
-  free(line);
-  fclose(fp);
-  // If the file is just loaded, it isn't modified.
-  E.modified = false;
-}
+  /** Row y ends with the first line of the text **/
+  E.row.size[y] = x;
+  E.row.chars[y][x] = '\0';
+  nl = memchr(s, '\n', len);
+  rowInsert(y, x, s, nl - s);
+  setModified();
 
+  *ey = last;
+  *ex = lastlen;
+}
 
 /**
- * Given the rows structure that displays all the rows to the
- * terminal screen, convert all to a single string.
- * @param length is the total length of all the
- * rows in the rows structure combined.
+ * Deletes the text between two positions of the buffer in
+ * a single pass. Row y1 is joined with what is left of row
+ * y2, the rows in between are removed with one shift.
+ * @param y1, x1 is the start of the range.
+ * @param y2, x2 is the end of the range, not included.
  */ 
-char *rowsToString(int *length) {
-  int totlen = 0;
-  /** Get the length of all the rows lengths
-   * combined **/
-  for (int i = 0; i < E.numrows; i++)
-    totlen += E.row[i].size + 1;
-  *length = totlen;
-
-  /** Allocate space to store the string in **/
-  char *string = malloc(totlen);
-  char *p = string; // a pointer to the string
-
-  for (int j = 0; j < E.numrows; j++) {
-    /** Iterate over the rows and copy every row to the
-     * allocated string location **/
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    /** move pointer to the start of next row **/
-    p += E.row[j].size; 
-    *p = '\n';
-    p++;
+void deleteRange(int y1, int x1, int y2, int x2) {
+  if (y1 >= E.numrows) return;
+  if (y2 >= E.numrows) {
+    /** Past the last row, delete up to its end **/
+    y2 = E.numrows - 1;
+    x2 = E.row.size[y2];
   }
-  return string;
+  if (y1 == y2) {
+    if (x2 > x1) rowDelete(y1, x1, x2 - x1);
+    return;
+  }
+
+  /** Row y1 keeps its head and takes the tail of row y2 **/
+  unpinRow(y1);
+  int taillen = E.row.size[y2] - x2;
+  E.row.size[y1] = x1;
+  E.row.chars[y1][x1] = '\0';
+  rowInsert(y1, x1, &E.row.chars[y2][x2], taillen);
+
+  /** Remove rows y1 + 1 to y2 **/
+  for (int at = y1 + 1; at <= y2; at++) freeRow(at);
+  shiftRows(y1 + 1, y2 + 1, E.numrows - y2 - 1);
+  E.numrows -= y2 - y1;
+  setModified();
 }
 
 /**
- * Save all the rows currently in the buffer into
- * a file.
- * If filename wasn't previously specified, prompt
- * user.
+ * Given a position and a number of bytes, finds the
+ * position that many bytes later. Newlines count as 1.
+ * @param y, x is the position, moved forward.
+ * @param len is the number of bytes.
  */ 
-void saveFile() {
-  /** Check if the file has a name, if not prompt **/
-  if (E.filename == NULL) E.filename = prompter();
-
-  /** Convert the rows structure, and take a single string **/
-  int len;
-  char *buf = rowsToString(&len);
-
-  /** Open the file, if doesn't exist create it. **/
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    /** If the file opens **/
-    if (ftruncate(fd, len) != -1) {
-      /** Truncate to the length of the rows **/
-      if (write(fd, buf, len) == len) {
-        /** Write to the file **/
-        appendChangeLog(buf, len); // Append to the change log
-        /** Clean up **/
-        close(fd);
-        free(buf);
-        E.modified = false;
-        setMessage("Saved successfully.");
-        return;
-      }
-    }
-    /** Unsucessfull truncate **/
-    close(fd);
+void advancePosition(int *y, int *x, int len) {
+  while (*y < E.numrows && len > E.row.size[*y] - *x) {
+    len -= E.row.size[*y] - *x + 1;
+    (*y)++;
+    *x = 0;
   }
-  /** File didn't open **/
-  free(buf);
-  setMessage("Error:", strerror(errno));
+  *x += len;
 }
 
 /**
- * Prompts the user when they try to quit
- * without saving.
+ * Deletes text at a position of the buffer, every
+ * newline deleted joins the row with the next one.
+ * @param y, x is the position to delete at.
+ * @param len is the number of bytes to delete.
  */ 
-void saveQuit() {
-  setMessage("Do you want to save before you quit? y/n");
-  displayScreen();
-  int c = readKey();
-  if (c == 'y' || c == 'Y') saveFile();
+void deleteText(int y, int x, int len) {
+  int y2 = y, x2 = x;
+  advancePosition(&y2, &x2, len);
+  deleteRange(y, x, y2, x2);
 }
 
 /**
- * Prompt the user to request information, displayed
- * on the message bar.
+ * Copies the text between two positions of the buffer
+ * into a new string, rows are separated by newlines.
+ * @param y1, x1 is the start of the range.
+ * @param y2, x2 is the end of the range, not included.
+ * @param len is set to the length of the text.
+ * @return the text, to be freed by the caller.
  */ 
-char* prompter() {
-  /** Allocate some space for the user input **/
-  int bufsize = 128; // initial size of input string
-  char *usrinput = malloc(bufsize);
-  int size = 0;
-  usrinput[0] = '\0';
-
-  while (1) {
-    /** Display the prompt on the message bar **/
-    setMessage("Enter filename: %s", usrinput);
-    displayScreen();
+char *yankRange(int y1, int x1, int y2, int x2, int *len) {
+  /** Measure the range first, hence one allocation **/
+  int total = 0;
+  for (int at = y1; at <= y2 && at < E.numrows; at++) {
+    int from = at == y1 ? x1 : 0;
+    int to = at == y2 ? x2 : E.row.size[at] + 1;
+    total += to - from;
+  }
 
-    int c = readKey(); // read the user keys
-    /** Enter key/return ends the prompt **/
-    if (c == '\r') {
-        break;
-    } else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-      /** Allow the user to delete **/
-      if (size != 0) usrinput[--size] = '\0';
-    } else if (!(iscntrl(c))) {
-      /** If not a control key, take it **/
-      if (size == bufsize - 1){
-        /** Reallocate if user exceeds initial size **/
-        bufsize *= 2;
-        usrinput = realloc(usrinput, bufsize);
-      }
-      usrinput[size++] = c;
-      usrinput[size] = '\0';
-    }
+  char *text = malloc(total + 1);
+  char *p = text;
+  for (int at = y1; at <= y2 && at < E.numrows; at++) {
+    int from = at == y1 ? x1 : 0;
+    int to = at == y2 ? x2 : E.row.size[at];
+    memcpy(p, &E.row.chars[at][from], to - from);
+    p += to - from;
+    if (at != y2) *p++ = '\n';
   }
-  return usrinput;
+  *len = p - text;
+  text[*len] = '\0';
+  return text;
 }
 
 /**
- * Copy the currently open file to a new file. The
- * name of the new file will be prompted. If the current
- * file isn't saved, user will be prompted to save.
+ * Records an edit for undo, and in the recovery journal.
+ * @param type is the opType.
+ * @param y, x is the position of the edit.
+ * @param s is the text of the edit, len its length.
+ * @param flags are the op flags.
+ * @return the op, NULL if out of memory.
  */ 
-void copyFile() {
-  /** First check if the current buffer is saved and has a filename **/
-  if (E.modified) saveFile();
-
-  /** Prompt for destination filename **/
-  char* dest = prompter();
-  char* source = strdup(E.filename);
-  if (strcmp(source, dest)==0) {
-    setMessage("Cannot copy a file to itself");
-    return;
-  } 
-
-  /** Open source to read and dest to write to **/
-  FILE *sourcef = fopen(source, "r");
-  FILE *destf = fopen(dest, "w");
-  if (!sourcef || !destf) {
-    die("Files failed to open");
-  }
-
-  /** Copy every character one by one to dest until
-  *  the end of the source file **/
-  int c;
-  while((c = fgetc(sourcef)) != EOF) fputc(c, destf);
-  setMessage("%s was sucessfully saved to %s.", source, dest);
-  /** Clean up file pointers **/
-  fclose(sourcef);
-  fclose(destf);
+op *recordOp(int type, int y, int x, const char *s, int len, int flags) {
+  recoverEdit(type, y, x, s, len);
+  return journalRecord(&E.journal, type, y, x, s, len, flags);
 }
 
 /**
- * Delete the current file. If buffer was never
- * saved, it can't be deleted.
+ * Records an insert for undo. Characters typed one
+ * after the other are coalesced into a single run.
+ * @param y, x is the position of the insert.
+ * @param s is the inserted text, len its length.
+ * @param flags are the op flags.
  */ 
-void deleteFile(){
-  /** Check if buffer was saved **/
-  if (E.filename) {
-    remove(E.filename);
-    write(STDOUT_FILENO, CLEAR_SCREEN);
-    write(STDOUT_FILENO, HOME_CURSOR);
-    exit(0);
-  } else{
-     setMessage("File doesn't exist.");
-  }
- 
+void recordInsert(int y, int x, const char *s, int len, int flags) {
+  recoverEdit(OP_INSERT, y, x, s, len);
+  op *last = E.journal.last;
+  if (flags == 0 && last && last == E.journal.cur && last->type == OP_INSERT
+    && last->y == y && last->x + last->len == x 
+    && !memchr(s, '\n', len) && !memchr(last->text, '\n', last->len)
+    && journalExtend(&E.journal, s, len))
+    return;
+  journalRecord(&E.journal, OP_INSERT, y, x, s, len, flags);
 }
 
 
 /******************************************************************************
-*                               Change Log                                    *
+*                               Selection                                     *
 ******************************************************************************/
 
 /**
- * Given a filename, creates its log filename.
- * @param filename is the file to be logged.
+ * Sets the selection anchor at the cursor when the user
+ * presses CTRL-B, or clears it if already set.
  */ 
-char* changeLogFilename(char *filename) {
-  char *logfilename = strdup(filename);
-  int index;
-  char *p;
-  if(strstr(logfilename, ".")!=NULL){
-    p = strchr(logfilename, '.');
-    index = (int) (p - logfilename);
-
-  }
-  /** Get rid of .txt extension and concatenate
-   * the .log extension then return **/
-  logfilename[strlen(filename) - index] = '\0'; 
-  strcat(logfilename,".log"); 
-  return logfilename;
+void toggleMark() {
+  E.mark = !E.mark;
+  E.my = E.cy;
+  E.mx = E.cx;
+  setMessage(E.mark ? "Mark set." : "Mark cleared.");
 }
 
-#define SPACE 4
-#define BAR_LENGTH 20
-#define NEWLINE fputs("\n", fp);
-
 /**
- * For a given buffer, creates or appends to a 
- * log file with a timestamp and the number of 
- * written lines.
- * @param buf is the file buffer to be logged
- * @param len is the length of the buffer.
+ * Gets the selection between the anchor and the cursor,
+ * in buffer order and within the buffer.
+ * @param y1, x1 is set to the start of the selection.
+ * @param y2, x2 is set to its end, not included.
+ * @return false if there is no selection.
  */ 
-void appendChangeLog(char *buf, int len){
-  /** For the current file, create a .log file **/
-  char *filename = changeLogFilename(E.filename);
-  char *rows = malloc(50);
-  time_t t; 
-  time(&t); // get the current time.
-
-  FILE *fp = fopen(filename, "ab");
-
-  /** Draw a bar on top of every appended
-   * log **/
-  for (int i=0;i<BAR_LENGTH;i++)
-    fputs("#####", fp);
-  NEWLINE
-
-  /** Append a timestamp for every log save **/
-  fputs("Time of save: ", fp);
-  fputs(ctime(&t), fp);
+bool getSelection(int *y1, int *x1, int *y2, int *x2) {
+  if (!E.mark || E.numrows == 0) return false;
+  int ay = E.my, ax = E.mx, by = E.cy, bx = E.cx;
+  if (ay > by || (ay == by && ax > bx)) {
+    ay = E.cy; ax = E.cx;
+    by = E.my; bx = E.mx;
+  }
 
-  /** Append the current file to the log with, 
-   * even amounts of space in between **/
-  for (int i=1; i<=(SPACE*2)-1;i++) {
-    if (i % SPACE == 0)
-      fputs(buf, fp);
-    else
-      NEWLINE
+  /** The anchor may be stale after an edit **/
+  if (ay >= E.numrows) return false;
+  if (by >= E.numrows) {
+    by = E.numrows - 1;
+    bx = E.row.size[by];
   }
+  if (ax > E.row.size[ay]) ax = E.row.size[ay];
+  if (bx > E.row.size[by]) bx = E.row.size[by];
 
-  /** Append the number of lines written **/
-  fputs("Total lines written: ", fp);
-  sprintf(rows, "%d", E.numrows);
-  fputs(rows, fp);
-  NEWLINE
+  *y1 = ay; *x1 = ax;
+  *y2 = by; *x2 = bx;
+  return true;
+}
+
+/**
+ * Copies the selection to the clipboard when the user
+ * presses CTRL-E, or cuts it on CTRL-W.
+ * @param cut is true if the selection is to be deleted.
+ */ 
+void copySelection(bool cut) {
+  int y1, x1, y2, x2;
+  if (!getSelection(&y1, &x1, &y2, &x2)) {
+    setMessage("No selection, Ctrl-B = SET MARK");
+    return;
+  }
+
+  free(clipboard.text);
+  clipboard.text = yankRange(y1, x1, y2, x2, &clipboard.len);
+
+  if (cut) {
+    recordOp(OP_DELETE, y1, x1, clipboard.text, clipboard.len, 0);
+    deleteRange(y1, x1, y2, x2);
+    E.cy = y1;
+    E.cx = x1;
+  }
+  E.mark = false;
+  setMessage("%s %d bytes.", cut ? "Cut" : "Copied", clipboard.len);
+}
+
+/**
+ * Inserts the clipboard at the cursor when the user
+ * presses CTRL-P.
+ */ 
+void paste() {
+  if (clipboard.text == NULL) {
+    setMessage("Clipboard is empty.");
+    return;
+  }
+  insertAtCursor(clipboard.text, clipboard.len);
+}
+
+/**
+ * Inserts text at the cursor as a single operation and
+ * moves the cursor after it.
+ * @param s is the text, len its length.
+ */ 
+void insertAtCursor(const char *s, int len) {
+  int flags = 0;
+  if (E.cy == E.numrows) {
+    writeRow(E.numrows, "", 0);
+    recordOp(OP_ADDROW, E.cy, 0, "", 0, 0);
+    flags = OP_CHAIN;
+  }
+  recordOp(OP_INSERT, E.cy, E.cx, s, len, flags);
+  insertText(E.cy, E.cx, s, len, &E.cy, &E.cx);
+}
+
+/**
+ * Reads a bracketed paste from the terminal up to its end
+ * marker, and inserts it in one go. Hence, the screen is
+ * drawn once for the whole paste instead of once per byte.
+ */ 
+void pasteInput() {
+  int cap = 4096, len = 0;
+  char *buf = malloc(cap);
+  if (buf == NULL) die("malloc");
+  int endlen = strlen(PASTE_END);
+  char *end = NULL;
+
+  /** Read big chunks until the end marker **/
+  while (end == NULL) {
+    if (len + 4096 > cap) {
+      char *grown = realloc(buf, cap * 2);
+      if (grown == NULL) die("realloc");
+      buf = grown;
+      cap *= 2;
+    }
+    int n = readInput(&buf[len], 4096);
+    if (n == -1) die("read");
+    if (n == 0) waitInput(-1);
+    int from = len > endlen ? len - endlen : 0;
+    len += n;
+    end = memmem(&buf[from], len - from, PASTE_END, endlen);
+  }
+
+  /** Keep what was typed after the paste for readKey **/
+  char *rest = end + endlen;
+  inputUnread(rest, buf + len - rest);
+  len = end - buf;
+
+  /** Terminals send returns, the buffer holds newlines **/
+  int n = 0;
+  for (int i = 0; i < len; i++) {
+    if (buf[i] == '\r') {
+      buf[n++] = '\n';
+      if (i + 1 < len && buf[i + 1] == '\n') i++;
+    } else {
+      buf[n++] = buf[i];
+    }
+  }
+
+  if (n > 0) insertAtCursor(buf, n);
+  free(buf);
+}
+
+
+/******************************************************************************
+*                               Undo/Redo                                     *
+******************************************************************************/
+
+/**
+ * Applies an edit to the buffer and moves the cursor to it.
+ * @param type is the opType, OP_UNLINK aside.
+ * @param y, x is the position of the edit.
+ * @param text is the text of the edit, len its length.
+ */ 
+void applyEdit(int type, int y, int x, const char *text, int len) {
+  switch (type) {
+    case OP_INSERT:
+      insertText(y, x, text, len, &E.cy, &E.cx);
+      break;
+    case OP_DELETE:
+      deleteText(y, x, len);
+      E.cy = y;
+      E.cx = x;
+      break;
+    case OP_ADDROW:
+      writeRow(y, (char *) text, len);
+      E.cy = y;
+      E.cx = 0;
+      break;
+    case OP_DELROW:
+      removeRow(y);
+      E.cy = y;
+      E.cx = 0;
+      break;
+  }
+  setModified();
+
+  /** Keep the cursor within the buffer **/
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  if (E.cy == E.numrows || E.cx > E.row.size[E.cy])
+    E.cx = E.cy < E.numrows ? E.row.size[E.cy] : 0;
+}
+
+/**
+ * Applies a recorded operation to the buffer, or its
+ * inverse when undoing. Moves the cursor to the edit.
+ * @param o is the operation.
+ * @param inverse is true when undoing.
+ */ 
+void applyOp(op *o, bool inverse) {
+  int type = o->type;
+  if (inverse) {
+    switch (type) {
+      case OP_INSERT: type = OP_DELETE; break;
+      case OP_DELETE: type = OP_INSERT; break;
+      case OP_ADDROW: type = OP_DELROW; break;
+      case OP_DELROW: type = OP_ADDROW; break;
+    }
+  }
+
+  if (type == OP_UNLINK) {
+    /** The buffer still holds the file, write it back. The
+     *  save clears the modified flag when it completes **/
+    if (inverse) {
+      saveFile();
+      return;
+    }
+    if (E.filename) remove(E.filename);
+    setModified();
+    return;
+  }
+  recoverEdit(type, o->y, o->x, o->text, o->len);
+  applyEdit(type, o->y, o->x, o->text, o->len);
+}
+
+/**
+ * Undoes the last operation when the user presses CTRL-Z,
+ * along with every op chained to it.
+ */ 
+void undo() {
+  op *o = journalUndo(&E.journal);
+  if (o == NULL) {
+    setMessage("Nothing to undo.");
+    return;
+  }
+  applyOp(o, true);
+  while ((o->flags & OP_CHAIN) && (o = journalUndo(&E.journal)) != NULL)
+    applyOp(o, true);
+}
+
+/**
+ * Redoes the last undone operation when the user presses
+ * CTRL-Y, along with every op chained to it.
+ */ 
+void redo() {
+  op *o = journalRedo(&E.journal);
+  if (o == NULL) {
+    setMessage("Nothing to redo.");
+    return;
+  }
+  applyOp(o, false);
+  while ((o = E.journal.cur->next) != NULL && (o->flags & OP_CHAIN)) {
+    journalRedo(&E.journal);
+    applyOp(o, false);
+  }
+}
+
+
+/******************************************************************************
+*                                 File I/O                                    *
+******************************************************************************/
+
+/**
+ * Given a filename, loads the file contents to row structures.
+ * The row structures are then displayed on the editing buffer.
+ * @param filename, name of the file to be loaded to display
+ */ 
+void loadFile(char *filename) {
+  /**   Set the filename globally **/
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  /** Open given file to read it **/
+  FILE *fp = fopen(filename, "r"); 
+  if (!fp) return;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  /** Until the end of the file, read each line and append to
+   *  rows **/
+  while ( (linelen = getline(&line, &linecap, fp)) != -1 ) {
+  /** Remove empty lines in between read lines **/
+  writeRow(E.numrows, line, trimLine(line, linelen));
+  }
 
   /** Clean up **/
+  free(line);
   fclose(fp);
+  // If the file is just loaded, it isn't modified.
+  E.modified = false;
+}
+
+/**
+ * Returns the length of a read line without its ending, the
+ * newline, or the carriage return of a last line without one.
+ * @param line is the line, len its length.
+ */ 
+size_t trimLine(const char *line, size_t len) {
+  if (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+  return len;
+}
+
+/**
+ * Splits a text into lines the way loadFile does, each
+ * without its newline, and hashes them to be diffed.
+ * @param t is where the lines are kept, it owns the text.
+ * @param text is the text, len its length.
+ * @return true if successful.
+ */ 
+bool splitLines(struct textLines *t, char *text, size_t len) {
+  memset(t, 0, sizeof(*t));
+  t->text = text;
+  t->size = len;
+  int lines = 0;
+  for (char *p = text; (p = memchr(p, '\n', text + len - p)) != NULL; p++)
+    lines++;
+  t->line = malloc(sizeof(char *) * (lines + 1));
+  t->len = malloc(sizeof(int) * (lines + 1));
+  t->hash = malloc(sizeof(unsigned long long) * (lines + 1));
+  if (!t->line || !t->len || !t->hash) return false;
+
+  char *p = text, *end = text + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *e = nl ? nl + 1 : end;
+    t->line[t->n] = p;
+    t->len[t->n] = trimLine(p, e - p);
+    t->hash[t->n] = lineHash(p, t->len[t->n]);
+    t->n++;
+    p = e;
+  }
+  return true;
+}
+
+void freeLines(struct textLines *t) {
+  free(t->text);
+  free(t->line);
+  free(t->len);
+  free(t->hash);
+}
+
+/**
+ * Closes the loaded file, all row payloads are released
+ * in bulk by the row allocator.
+ */ 
+void closeFile() {
+  /** The save may still be writing the rows **/
+  waitSave();
+  /** The pool is shared, only the last buffer releases it whole **/
+  if (buffers.n > 1) for (int i = 0; i < E.numrows; i++) freeRow(i);
+  else poolRelease(&pool);
+  journalFree(&E.journal);
+  E.numrows = 0;
+  E.cx = E.cy = E.rx = 0;
+  E.rowoff = E.coloff = 0;
+}
+
+
+/**
+ * Writes every row of a snapshot to a file, followed by
+ * a newline. The rows are gathered straight from the row
+ * text, IOV_MAX iovecs per writev.
+ * @param fd is the file descriptor.
+ * @param snap is the snapshot of the rows.
+ * @return 0 if successful, -1 on error.
+ */ 
+int writeRows(int fd, struct snapshot *snap) {
+  struct iovec iov[IOV_MAX];
+  int cnt = 0;
+  for (int j = 0; j < snap->numrows; j++) {
+    iov[cnt].iov_base = snap->chars[j];
+    iov[cnt++].iov_len = snap->size[j];
+    iov[cnt].iov_base = "\n";
+    iov[cnt++].iov_len = 1;
+    if (cnt + 2 > IOV_MAX || j == snap->numrows - 1) {
+      if (writeAll(fd, iov, cnt) == -1) return -1;
+      cnt = 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Writes the rows to a temporary file in the directory of
+ * path, syncs it and renames it over path. A crash leaves
+ * either the old or the new file, never a part of one.
+ * @param path is the file to be written.
+ * @param snap is the snapshot of the rows.
+ * @return 0 if successful, -1 on error.
+ */ 
+int writeFileAtomic(const char *path, struct snapshot *snap) {
+  /** Write through symbolic links, not over them **/
+  char *real = realpath(path, NULL);
+  const char *target = real ? real : path;
+
+  char *tmp = malloc(strlen(target) + 8);
+  sprintf(tmp, "%s.XXXXXX", target);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    free(tmp);
+    free(real);
+    return -1;
+  }
+
+  /** Keep the mode of the file, new files get the default **/
+  struct stat st;
+  mode_t mode;
+  if (stat(target, &st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0644 & ~mask;
+  }
+
+  int err = fchmod(fd, mode) == -1 || writeRows(fd, snap) == -1 
+    || fsync(fd) == -1;
+  if (close(fd) == -1) err = 1;
+  if (!err && rename(tmp, target) == -1) err = 1;
+  if (err) {
+    int saved = errno;
+    unlink(tmp);
+    errno = saved;
+  } else {
+    /** Make the rename itself durable **/
+    char *slash = strrchr(tmp, '/');
+    const char *dirname = ".";
+    if (slash == tmp) dirname = "/";
+    else if (slash) {
+      *slash = '\0';
+      dirname = tmp;
+    }
+    int dir = open(dirname, O_RDONLY | O_DIRECTORY);
+    if (dir != -1) {
+      fsync(dir);
+      close(dir);
+    }
+  }
+  free(tmp);
+  free(real);
+  return err ? -1 : 0;
+}
+
+/**
+ * Marks the buffer as modified, and counts the modification
+ * hence a save knows whether it wrote the latest text.
+ */ 
+void setModified() {
+  E.modified = true;
+  E.editseq++;
+}
+
+/**
+ * Gives the text of a row a block of its own if a save is
+ * writing the current one. Called before the text is changed.
+ * @param at is the index of the row.
+ */ 
+void unpinRow(int at) {
+  if (!(E.row.flags[at] & ROW_PINNED)) return;
+  int size = E.row.size[at];
+  char *copy = poolAlloc(&pool, size + 1);
+  memcpy(copy, E.row.chars[at], size);
+  copy[size] = '\0';
+  deferFree(E.row.chars[at], E.row.ccap[at]);
+  E.row.chars[at] = copy;
+  E.row.ccap[at] = poolCapacity(size + 1);
+  E.row.flags[at] &= ~ROW_PINNED;
+}
+
+/**
+ * Keeps a block that a save is writing, it is freed when
+ * the save ends.
+ * @param p is the block, cap its capacity.
+ */ 
+void deferFree(void *p, int cap) {
+  if (save.ndeferred == save.capdeferred) {
+    save.capdeferred = save.capdeferred ? save.capdeferred * 2 : 64;
+    save.deferred = realloc(save.deferred, sizeof(void *) * save.capdeferred);
+    save.defcap = realloc(save.defcap, sizeof(int) * save.capdeferred);
+    if (!save.deferred || !save.defcap) die("realloc");
+  }
+  save.deferred[save.ndeferred] = p;
+  save.defcap[save.ndeferred++] = cap;
+}
+
+/**
+ * Runs on the worker thread, writes the snapshot to the
+ * file and the change log. Only the snapshot is read, the
+ * editor keeps running meanwhile.
+ */ 
+void *saveWorker(void *arg) {
+  (void) arg;
+  save.err = 0;
+  if (writeFileAtomic(save.snap.filename, &save.snap) == -1)
+    save.err = errno;
+  else
+    appendChangeLog(&save.snap); // Append to the change log
+
+  /** Wake the main loop up **/
+  write(events.saved[1], "", 1);
+  return NULL;
+}
+
+/**
+ * Ends the running save: reports it, frees the blocks
+ * edited meanwhile and unpins the rows. The buffer is only
+ * unmodified if no edit came after the save began.
+ */ 
+void finishSave() {
+  if (!save.running) return;
+  if (save.threaded) pthread_join(save.thread, NULL);
+  save.running = false;
+  char c;
+  while (read(events.saved[0], &c, 1) > 0);
+
+  if (save.err) {
+    setMessage("Error: %s", strerror(save.err));
+  } else {
+    if (E.editseq == save.editseq) E.modified = false;
+    setMessage("Saved successfully.");
+    /** The journal only keeps the edits made since **/
+    struct recoverBase base = fileBase(save.snap.filename);
+    if (recovery.path) recoverRebase(&recovery, base, save.journaled);
+    else startRecovery(save.snap.filename, base);
+    /** What was saved is the version on disk now **/
+    if (watch.wd == -1) watchFile(save.snap.filename);
+    unsigned long long *hash = malloc(sizeof(*hash) * (save.snap.numrows + 1));
+    if (hash == NULL) die("malloc");
+    for (int i = 0; i < save.snap.numrows; i++)
+      hash[i] = lineHash(save.snap.chars[i], save.snap.size[i]);
+    setKnown(base, hash, save.snap.numrows, true);
+    free(hash);
+  }
+
+  for (int i = 0; i < save.ndeferred; i++)
+    poolFree(&pool, save.deferred[i], save.defcap[i]);
+  save.ndeferred = 0;
+  for (int i = 0; i < E.numrows; i++) E.row.flags[i] &= ~ROW_PINNED;
+  free(save.snap.chars);
+  free(save.snap.size);
+  free(save.snap.filename);
+  memset(&save.snap, 0, sizeof(save.snap));
+
+  /** Changes made on disk during the save **/
+  if (watch.pending) {
+    watch.pending = false;
+    checkFile();
+  }
+}
+
+/**
+ * Waits for the running save to end, if any.
+ */ 
+void waitSave() {
+  finishSave();
+}
+
+/**
+ * Save all the rows currently in the buffer into
+ * a file.
+ * If filename wasn't previously specified, prompt
+ * user. The rows are pinned and written by a worker
+ * thread, hence editing carries on during the save.
+ */ 
+void saveFile() {
+  /** Check if the file has a name, if not prompt **/
+  if (E.filename == NULL) E.filename = prompter();
+  /** One save at a time **/
+  waitSave();
+
+  /** Snapshot the rows, only their pointers and sizes **/
+  struct snapshot *snap = &save.snap;
+  snap->numrows = E.numrows;
+  snap->chars = malloc(sizeof(char *) * (E.numrows + 1));
+  snap->size = malloc(sizeof(int) * (E.numrows + 1));
+  snap->filename = strdup(E.filename);
+  if (!snap->chars || !snap->size || !snap->filename) die("malloc");
+  memcpy(snap->chars, E.row.chars, sizeof(char *) * E.numrows);
+  memcpy(snap->size, E.row.size, sizeof(int) * E.numrows);
+  for (int i = 0; i < E.numrows; i++) E.row.flags[i] |= ROW_PINNED;
+  save.editseq = E.editseq;
+  save.journaled = recoverSize(&recovery);
+
+  save.running = true;
+  save.threaded = pthread_create(&save.thread, NULL, saveWorker, NULL) == 0;
+  if (!save.threaded) {
+    /** Without a thread, save right here **/
+    saveWorker(NULL);
+    finishSave();
+    return;
+  }
+  setMessage("Saving %s...", E.filename);
+}
+
+/**
+ * Prompts the user when they try to quit
+ * without saving.
+ */ 
+void saveQuit() {
+  setMessage("Do you want to save before you quit? y/n");
+  displayScreen();
+  int c = readKey();
+  if (c == 'y' || c == 'Y') saveFile();
+  else E.modified = false; // the edits are given up
+}
+
+/**
+ * Prompt the user to request information, displayed
+ * on the message bar.
+ */ 
+char* prompter() {
+  /** Allocate some space for the user input **/
+  int bufsize = 128; // initial size of input string
+  char *usrinput = malloc(bufsize);
+  int size = 0;
+  usrinput[0] = '\0';
+
+  while (1) {
+    /** Display the prompt on the message bar **/
+    setMessage("Enter filename: %s", usrinput);
+    displayScreen();
+
+    int c = readKey(); // read the user keys
+    /** Enter key/return ends the prompt **/
+    if (c == '\r') {
+        break;
+    } else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      /** Allow the user to delete **/
+      if (size != 0) usrinput[--size] = '\0';
+    } else if (!(iscntrl(c))) {
+      /** If not a control key, take it **/
+      if (size == bufsize - 1){
+        /** Reallocate if user exceeds initial size **/
+        bufsize *= 2;
+        usrinput = realloc(usrinput, bufsize);
+      }
+      usrinput[size++] = c;
+      usrinput[size] = '\0';
+    }
+  }
+  return usrinput;
+}
+
+/**
+ * Copies up to len bytes between two files, without
+ * passing them through the editor if the kernel can.
+ * copy_file_range is tried first, it may share the blocks.
+ * Then sendfile, and at last a read/write loop.
+ * @param in, out are the file descriptors.
+ * @param len is the number of bytes wanted.
+ * @param method is where the working way is kept between
+ * calls, 0 to begin with copy_file_range.
+ * @return the number of bytes copied, 0 at the end, -1 on error.
+ */ 
+ssize_t copyChunk(int in, int out, size_t len, int *method) {
+  ssize_t n;
+  if (*method == 0) {
+    n = copy_file_range(in, NULL, out, NULL, len, 0);
+    if (n >= 0) return n;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && 
+      errno != EOPNOTSUPP && errno != EBADF) return -1;
+    *method = 1;
+  }
+  if (*method == 1) {
+    n = sendfile(out, in, NULL, len);
+    if (n >= 0) return n;
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+    *method = 2;
+  }
+
+  static char *buf;
+  if (buf == NULL && (buf = malloc(COPY_BUFFER)) == NULL) return -1;
+  n = read(in, buf, len < COPY_BUFFER ? len : COPY_BUFFER);
+  if (n <= 0) return n;
+  struct iovec iov = {buf, n};
+  if (writeAll(out, &iov, 1) == -1) return -1;
+  return n;
+}
+
+/**
+ * Copy the currently open file to a new file. The
+ * name of the new file will be prompted. If the current
+ * file isn't saved, user will be prompted to save.
+ * Big files show their progress on the message bar.
+ */ 
+void copyFile() {
+  if (E.filename == NULL) {
+    setMessage("Save the buffer before copying it.");
+    return;
+  }
+  /** First check if the current buffer is saved and has a filename **/
+  if (E.modified) saveFile();
+  /** The copy is taken from the saved file **/
+  waitSave();
+
+  /** Prompt for destination filename **/
+  char* dest = prompter();
+  char* source = E.filename;
+  if (strcmp(source, dest)==0) {
+    setMessage("Cannot copy a file to itself");
+    free(dest);
+    return;
+  } 
+
+  /** Open source to read and dest to write to **/
+  int in = open(source, O_RDONLY);
+  struct stat st;
+  if (in == -1 || fstat(in, &st) == -1) {
+    setMessage("Error: %s: %s", source, strerror(errno));
+    if (in != -1) close(in);
+    free(dest);
+    return;
+  }
+  int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if (out == -1) {
+    setMessage("Error: %s: %s", dest, strerror(errno));
+    close(in);
+    free(dest);
+    return;
+  }
+
+  /** Copy a chunk at a time, hence the progress can be shown **/
+  long long done = 0;
+  int method = 0;
+  ssize_t n;
+  while ((n = copyChunk(in, out, COPY_CHUNK, &method)) > 0) {
+    done += n;
+    if (st.st_size > COPY_CHUNK) {
+      setMessage("Copying %s to %s: %lld%%", source, dest,
+        done * 100 / st.st_size);
+      displayScreen();
+    }
+  }
+
+  if (n == -1 || close(out) == -1)
+    setMessage("Error: %s: %s", dest, strerror(errno));
+  else
+    setMessage("%s was sucessfully saved to %s.", source, dest);
+  if (n == -1) close(out);
+  close(in);
+  free(dest);
+}
+
+/**
+ * Delete the current file. If buffer was never
+ * saved, it can't be deleted. The buffer stays open.
+ */ 
+void deleteFile(){
+  waitSave();
+  /** Check if buffer was saved **/
+  if (E.filename) {
+    /** Keep the buffer open, hence the deletion can be
+     * undone by writing it back **/
+    if (remove(E.filename) == -1) {
+      setMessage("Error: %s", strerror(errno));
+      return;
+    }
+    journalRecord(&E.journal, OP_UNLINK, 0, 0, "", 0, 0);
+    setModified();
+    setMessage("%s was deleted. Ctrl-Z = RESTORE", E.filename);
+  } else{
+     setMessage("File doesn't exist.");
+  }
+ 
+}
+
+
+/******************************************************************************
+*                                Recovery                                     *
+******************************************************************************/
+
+/**
+ * Given a filename, creates the name of its recovery
+ * journal, .<name>.recover in the same directory.
+ * @param filename is the edited file.
+ */ 
+char *recoveryFilename(const char *filename) {
+  char *path = malloc(strlen(filename) + 10);
+  const char *slash = strrchr(filename, '/');
+  int dir = slash ? slash - filename + 1 : 0;
+  sprintf(path, "%.*s.%s.recover", dir, filename, filename + dir);
+  return path;
+}
+
+/**
+ * Returns the size and modification time of a file, a
+ * journal only applies to the version it was made against.
+ * @param filename is the file.
+ */ 
+struct recoverBase fileBase(const char *filename) {
+  struct recoverBase base = {-1, 0};
+  struct stat st;
+  if (stat(filename, &st) == 0) {
+    base.size = st.st_size;
+    base.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+  return base;
+}
+
+/**
+ * Buffers an edit in the recovery journal. It is written
+ * when the main loop finds it due, never per key.
+ */ 
+void recoverEdit(int type, int y, int x, const char *s, int len) {
+  if (recovery.path == NULL || E.deferrender) return;
+  if (recoverRecord(&recovery, type, y, x, s, len, monotonicMs()) == -1)
+    setMessage("Recovery journal: %s", strerror(errno));
+}
+
+/**
+ * Returns the time until the buffered edits are due in the
+ * recovery journal: once no edit came for RECOVER_IDLE_MS,
+ * or options.recoverms after the oldest one while they
+ * keep coming.
+ * @return the time in ms, -1 if nothing is buffered.
+ */ 
+int recoveryDue() {
+  if (recovery.len == 0) return -1;
+  long long due = recovery.at + RECOVER_IDLE_MS;
+  if (recovery.since + options.recoverms < due)
+    due = recovery.since + options.recoverms;
+  long long wait = due - monotonicMs();
+  return wait > 0 ? wait : 0;
+}
+
+/**
+ * Keeps the first need rows of the file in the table while a
+ * journal is replayed, the ones below are set aside. Edits
+ * mostly move down the file, hence every row is moved about
+ * once instead of being shifted by every added row.
+ * @param need is the number of rows, rows set aside included.
+ */ 
+void replayWindow(int need) {
+  while (E.numrows > need) {
+    growTable(&aside.row, aside.n + 1);
+    moveRow(&aside.row, aside.n++, &E.row, --E.numrows);
+  }
+  while (E.numrows < need && aside.n > 0) {
+    growRows(E.numrows + 1);
+    moveRow(&E.row, E.numrows++, &aside.row, --aside.n);
+  }
+}
+
+/**
+ * Applies a replayed edit, if it fits the buffer. Only the
+ * rows up to the ones it reaches are in the table.
+ * @return false if it doesn't, replay stops there.
+ */ 
+bool replayEdit(int type, int y, int x, const char *text, int len, void *arg) {
+  (void) arg;
+  int numrows = E.numrows + aside.n;
+  if (y < 0 || x < 0 || y > numrows) return false;
+  /** A delete may join a row per byte **/
+  long long need = y + 1LL + (type == OP_DELETE ? len + 1LL : 0);
+  replayWindow(need < numrows ? need : numrows);
+  int size = y < E.numrows ? E.row.size[y] : 0;
+  switch (type) {
+    case OP_INSERT:
+      if (x > size) return false;
+      break;
+    case OP_DELETE:
+    case OP_DELROW:
+      if (y == numrows || x > size) return false;
+      break;
+    case OP_ADDROW:
+      break;
+    default:
+      return false;
+  }
+  applyEdit(type, y, x, text, len);
+  return true;
+}
+
+/**
+ * Replays a recovery journal onto the loaded file. Rows
+ * are rendered once at the end, not once per edit, and
+ * the rows set aside are put back once.
+ * @param path is the journal.
+ * @param base is the loaded version of the file.
+ * @param n is the number of edits it holds.
+ */ 
+void replayJournal(const char *path, struct recoverBase *base, long long n) {
+  long long start = traceNow();
+  E.deferrender = true;
+  long long done = recoverReplay(path, base, replayEdit, NULL);
+  replayWindow(INT_MAX);
+  freeTable(&aside.row);
+  E.deferrender = false;
+  for (int at = 0; at < E.numrows; at++)
+    if (E.row.flags[at] & ROW_STALE) updateRow(at);
+  wrap.valid = false;
+
+  if (done < n)
+    setMessage("Recovered %lld of %lld edits, the rest don't fit the file.",
+      done, n);
+  else
+    setMessage("Recovered %lld edits in %.1f ms.", done, (traceNow() - start) / 1e6);
+}
+
+/**
+ * Starts journaling the edits of a file, a journal that
+ * is left over is dropped.
+ * @param filename is the file.
+ * @param base is its version on disk.
+ */ 
+void startRecovery(const char *filename, struct recoverBase base) {
+  char *path = recoveryFilename(filename);
+  unlink(path);
+  recoverInit(&recovery, path, base);
+  free(path);
+}
+
+/**
+ * Starts journaling the edits of the loaded file. A journal
+ * left by an editor that didn't quit is offered for replay.
+ * One made against another version of the file is moved
+ * aside to .<name>.recover.old.
+ */ 
+void recoverFile() {
+  char *path = recoveryFilename(E.filename);
+  struct recoverBase base = fileBase(E.filename);
+  long long n = recoverReplay(path, &base, NULL, NULL);
+  if (n == -2) {
+    char *old = malloc(strlen(path) + 5);
+    sprintf(old, "%s.old", path);
+    rename(path, old);
+    setMessage("%s changed since its recovery journal, kept in %s", E.filename, old);
+    free(old);
+  } else if (n > 0) {
+    setMessage("%s has %lld unsaved edits, recover them? y/n", E.filename, n);
+    displayScreen();
+    int c = readKey();
+    if (c == 'y' || c == 'Y') replayJournal(path, &base, n);
+    else unlink(path);
+  } else {
+    unlink(path);
+  }
+  recoverInit(&recovery, path, base);
+  free(path);
+}
+
+
+/******************************************************************************
+*                               File Watch                                    *
+******************************************************************************/
+
+/**
+ * Watches the directory of the loaded file with inotify, the
+ * file may be replaced by a rename. Its current version on disk
+ * becomes the known one.
+ * @param filename is the loaded file.
+ */ 
+void watchFile(const char *filename) {
+  if (events.inotify == -1)
+    events.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (events.inotify == -1) return;
+  dropWatch();
+
+  const char *slash = strrchr(filename, '/');
+  char *dir = slash ? strndup(filename, slash - filename + 1) : strdup(".");
+  free(watch.name);
+  watch.name = strdup(slash ? slash + 1 : filename);
+  watch.wd = inotify_add_watch(events.inotify, dir, IN_MODIFY | IN_CLOSE_WRITE |
+    IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+  free(dir);
+
+  unsigned long long *hash = rowHashes();
+  setKnown(fileBase(filename), hash, E.numrows, endsWithNewline(filename));
+  free(hash);
+}
+
+/**
+ * Returns whether the last byte of a file is a newline.
+ */ 
+bool endsWithNewline(const char *filename) {
+  char c = 0;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) pread(fd, &c, 1, st.st_size - 1);
+  close(fd);
+  return c == '\n';
+}
+
+/**
+ * Returns the hashes of the rows, to be freed by the caller.
+ */ 
+unsigned long long *rowHashes() {
+  unsigned long long *hash = malloc(sizeof(*hash) * (E.numrows + 1));
+  if (hash == NULL) die("malloc");
+  for (int at = 0; at < E.numrows; at++)
+    hash[at] = lineHash(E.row.chars[at], E.row.size[at]);
+  return hash;
+}
+
+/**
+ * Returns the rows as a text to diff.
+ * @param hash is their hashes, from rowHashes.
+ */ 
+struct diffText rowText(const unsigned long long *hash) {
+  return (struct diffText) {hash, E.row.chars, E.row.size, E.numrows};
+}
+
+/**
+ * Returns split lines as a text to diff.
+ */ 
+struct diffText linesText(const struct textLines *t) {
+  return (struct diffText) {t->hash, t->line, t->len, t->n};
+}
+
+/**
+ * Takes note of the version of the file on disk that the
+ * rows were read from or saved as, its lines are the base
+ * of a merge.
+ * @param base is the version.
+ * @param hash is its line hashes, n of them.
+ * @param newline is true if it ends with a newline.
+ */ 
+void setKnown(struct recoverBase base, unsigned long long *hash, int n,
+  bool newline) {
+  watch.known = base;
+  watch.newline = newline;
+  watch.hash = realloc(watch.hash, sizeof(*hash) * (n + 1));
+  if (watch.hash == NULL) die("realloc");
+  memcpy(watch.hash, hash, sizeof(*hash) * n);
+  watch.nhash = n;
+}
+
+/**
+ * Reads the events of the watch. Only the ones of the file
+ * count, and a single check is made for all of them.
+ * @return true if the file may have changed.
+ */ 
+bool watchEvents() {
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  ssize_t n;
+  while ((n = read(events.inotify, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n; ) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->len == 0) continue;
+      if (ev->wd == watch.wd && strcmp(ev->name, watch.name) == 0) {
+        changed = true;
+        continue;
+      }
+      /** The other buffers check theirs when shown **/
+      for (int i = 0; i < buffers.n; i++) {
+        struct watch *w = &buffers.list[i].watch;
+        if (i != buffers.cur && w->wd == ev->wd && w->name
+          && strcmp(ev->name, w->name) == 0) w->pending = true;
+      }
+    }
+  }
+  if (!changed) return false;
+
+  /** Our own save is told apart once it ends **/
+  if (save.running) watch.pending = true;
+  else checkFile();
+  return true;
+}
+
+/**
+ * Replaces rows of the table with lines, removing and
+ * inserting with one shift each.
+ * @param at is the first row replaced.
+ * @param count is the number of rows replaced.
+ * @param line, len are the new lines, n of them.
+ */ 
+void replaceRows(int at, int count, char **line, int *len, int n) {
+  if (count > 0) {
+    for (int i = at; i < at + count; i++) freeRow(i);
+    shiftRows(at, at + count, E.numrows - at - count);
+    E.numrows -= count;
+  }
+  if (n > 0) {
+    growRows(E.numrows + n);
+    shiftRows(at + n, at, E.numrows - at);
+    for (int i = 0; i < n; i++) fillRow(at + i, line[i], len[i]);
+    E.numrows += n;
+  }
+  setModified();
+}
+
+/**
+ * Maps a row through an edit script to the row it becomes.
+ * A deleted row maps to where it was.
+ * @param y is the row in the old text.
+ * @param m is the number of lines of the new text.
+ */ 
+int mapRow(struct diffOp *ops, int nops, int y, int m) {
+  for (int i = 0; i < nops; i++) {
+    if (ops[i].type == DIFF_INSERT || y >= ops[i].a + ops[i].n) continue;
+    return ops[i].type == DIFF_EQUAL ? ops[i].b + y - ops[i].a : ops[i].b;
+  }
+  return m;
+}
+
+/**
+ * Makes the rows the lines of the file on disk. Only the
+ * changed hunks are replaced, from the last one up, and the
+ * cursor stays on the line it was on.
+ * @param t is the file on disk, base its version.
+ * @return the number of lines that changed, -1 on error.
+ */ 
+int reloadRows(struct textLines *t, struct recoverBase base) {
+  unsigned long long *mine = rowHashes();
+  struct diffText a = rowText(mine), b = linesText(t);
+  struct diffOp *ops;
+  int nops = diffLines(&a, &b, &ops);
+  free(mine);
+  if (nops == -1) return -1;
+
+  int changed = 0;
+  int cy = mapRow(ops, nops, E.cy, t->n);
+  int rowoff = mapRow(ops, nops, E.rowoff, t->n);
+  for (int i = nops - 1; i >= 0; i--) {
+    if (ops[i].type == DIFF_EQUAL) continue;
+    /** The runs between two equal ones make a hunk **/
+    int j = i, del = 0, ins = 0;
+    while (j > 0 && ops[j - 1].type != DIFF_EQUAL) j--;
+    for (int k = j; k <= i; k++) {
+      if (ops[k].type == DIFF_DELETE) del += ops[k].n;
+      else ins += ops[k].n;
+    }
+    replaceRows(ops[j].a, del, &t->line[ops[j].b], &t->len[ops[j].b], ins);
+    changed += del > ins ? del : ins;
+    i = j;
+  }
+  free(ops);
+
+  if (!E.softwrap) E.rowoff = rowoff;
+  E.cy = cy;
+  if (E.cy == E.numrows || E.cx > E.row.size[E.cy])
+    E.cx = E.cy < E.numrows ? E.row.size[E.cy] : 0;
+  setKnown(base, t->hash, t->n, t->size > 0 && t->text[t->size - 1] == '\n');
+  return changed;
+}
+
+/**
+ * Rebases the recovery journal on the file on disk. The rows
+ * differ from it by the edits made here, they are journaled
+ * as rows removed and added.
+ * @param t is the file on disk.
+ */ 
+void resyncRecovery(struct textLines *t) {
+  recoverRebase(&recovery, watch.known, recoverSize(&recovery));
+  if (recovery.path == NULL) return;
+  unsigned long long *mine = rowHashes();
+  struct diffText a = linesText(t), b = rowText(mine);
+  struct diffOp *ops;
+  int nops = diffLines(&a, &b, &ops);
+  free(mine);
+  for (int i = 0; i < nops; i++) {
+    struct diffOp *op = &ops[i];
+    for (int k = 0; k < op->n; k++) {
+      if (op->type == DIFF_DELETE)
+        recoverEdit(OP_DELROW, op->b, 0, t->line[op->a + k], t->len[op->a + k]);
+      else if (op->type == DIFF_INSERT)
+        recoverEdit(OP_ADDROW, op->b + k, 0, E.row.chars[op->b + k],
+          E.row.size[op->b + k]);
+    }
+  }
+  if (nops != -1) free(ops);
+}
+
+/**
+ * Merges the changes made on disk into the rows, which have
+ * edits of their own. Changes to lines that weren't edited
+ * here are taken, lines changed on both sides are kept
+ * between conflict markers.
+ * @param t is the file on disk, base its version.
+ * @return the number of conflicts, -1 on error.
+ */ 
+int mergeRows(struct textLines *t, struct recoverBase base) {
+  unsigned long long *mine = rowHashes();
+  /** Only the hashes of the base are kept **/
+  struct diffText known = {watch.hash, NULL, NULL, watch.nhash};
+  struct diffText yours = rowText(mine), theirs = linesText(t);
+  struct mergeChunk *chunks;
+  int n = diffMerge(&known, &yours, &theirs, &chunks);
+  free(mine);
+  if (n == -1) return -1;
+
+  char *marks[2] = {"<<<<<<< yours", "======="};
+  int conflicts = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    struct mergeChunk *c = &chunks[i];
+    if (!c->conflict) {
+      replaceRows(c->m, c->mn, &t->line[c->t], &t->len[c->t], c->tn);
+      continue;
+    }
+    /** Theirs goes after yours, between the markers **/
+    char **line = malloc(sizeof(char *) * (c->tn + 2));
+    int *len = malloc(sizeof(int) * (c->tn + 2));
+    char end[80];
+    line[0] = marks[1];
+    len[0] = strlen(marks[1]);
+    memcpy(&line[1], &t->line[c->t], sizeof(char *) * c->tn);
+    memcpy(&len[1], &t->len[c->t], sizeof(int) * c->tn);
+    line[c->tn + 1] = end;
+    len[c->tn + 1] = snprintf(end, sizeof(end), ">>>>>>> %s on disk", watch.name);
+    replaceRows(c->m + c->mn, 0, line, len, c->tn + 2);
+    len[0] = strlen(marks[0]);
+    replaceRows(c->m, 0, &marks[0], len, 1);
+    free(line);
+    free(len);
+    conflicts++;
+  }
+  free(chunks);
+  setKnown(base, t->hash, t->n, t->size > 0 && t->text[t->size - 1] == '\n');
+  return conflicts;
+}
+
+/**
+ * Appends what was written at the end of the file since the
+ * known version, if that is all that changed. Only the new
+ * bytes are read, hence a growing log is followed cheaply.
+ * @param base is the version on disk.
+ * @return true if the rows were brought up to date.
+ */ 
+bool appendTail(struct recoverBase base) {
+  if (E.modified || watch.known.size < 0 || base.size <= watch.known.size
+    || E.numrows != watch.nhash) return false;
+
+  /** The last known row is read again, to tell a growing
+   *  file from a rewritten one **/
+  int last = E.numrows - 1;
+  long long check = last >= 0 ? E.row.size[last] + watch.newline : 0;
+  if (check > watch.known.size) return false;
+  long long from = watch.known.size - check;
+  size_t len = base.size - from;
+  int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  char *buf = malloc(len);
+  bool ok = buf && pread(fd, buf, len, from) == (ssize_t) len;
+  close(fd);
+  if (ok && last >= 0)
+    ok = memcmp(buf, E.row.chars[last], E.row.size[last]) == 0
+      && (!watch.newline || buf[check - 1] == '\n');
+  if (!ok) {
+    free(buf);
+    return false;
+  }
+
+  char *p = buf + check, *end = buf + len;
+  if (!watch.newline && last >= 0) {
+    /** The last row wasn't finished **/
+    char *nl = memchr(p, '\n', end - p);
+    char *e = nl ? nl + 1 : end;
+    rowInsert(last, E.row.size[last], p, trimLine(p, e - p));
+    watch.hash[last] = lineHash(E.row.chars[last], E.row.size[last]);
+    p = e;
+  }
+  int first = E.numrows;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *e = nl ? nl + 1 : end;
+    writeRow(E.numrows, p, trimLine(p, e - p));
+    p = e;
+  }
+  watch.hash = realloc(watch.hash, sizeof(*watch.hash) * (E.numrows + 1));
+  if (watch.hash == NULL) die("realloc");
+  for (int at = first; at < E.numrows; at++)
+    watch.hash[at] = lineHash(E.row.chars[at], E.row.size[at]);
+  watch.nhash = E.numrows;
+  watch.newline = buf[len - 1] == '\n';
+  watch.known = base;
+  free(buf);
+
+  E.modified = false;
+  recoverRebase(&recovery, base, recoverSize(&recovery));
+  if (watch.follow) {
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+    E.cx = 0;
+  }
+  return true;
+}
+
+/**
+ * Reads the whole file from disk into lines.
+ * @param t is where the lines are kept.
+ * @param base is set to the version read.
+ * @return true if successful.
+ */ 
+bool readDisk(struct textLines *t, struct recoverBase *base) {
+  memset(t, 0, sizeof(*t));
+  int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1) close(fd);
+    return false;
+  }
+  char *text = malloc(st.st_size + 1);
+  ssize_t n = text ? read(fd, text, st.st_size) : -1;
+  close(fd);
+  if (n != st.st_size) {
+    free(text);
+    return false;
+  }
+  base->size = st.st_size;
+  base->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return splitLines(t, text, n);
+}
+
+/**
+ * Compares the file on disk with the version the rows
+ * came from, after an event of the watch. If it changed
+ * and there are no edits, the rows follow it. Otherwise
+ * the user can merge, reload or keep their rows.
+ */ 
+void checkFile() {
+  if (E.filename == NULL) return;
+  struct recoverBase base = fileBase(E.filename);
+  if (base.size == watch.known.size && base.mtime == watch.known.mtime) return;
+  if (base.size == -1) {
+    setMessage("%s was removed from disk.", E.filename);
+    watch.known = base;
+    return;
+  }
+  if (appendTail(base)) return;
+
+  struct textLines t;
+  if (!readDisk(&t, &base)) {
+    freeLines(&t);
+    return;
+  }
+  if (!E.modified) {
+    int changed = reloadRows(&t, base);
+    journalFree(&E.journal);
+    E.modified = false;
+    recoverRebase(&recovery, base, recoverSize(&recovery));
+    setMessage("%s changed on disk, %d lines reloaded.", E.filename, changed);
+    freeLines(&t);
+    return;
+  }
+
+  setMessage("%s changed on disk: M = MERGE | R = RELOAD | K = KEEP YOURS",
+    E.filename);
+  displayScreen();
+  int c = readKey();
+  if (c == 'm' || c == 'M') {
+    int conflicts = mergeRows(&t, base);
+    journalFree(&E.journal);
+    resyncRecovery(&t);
+    setMessage("Merged %s, %d conflicts.", E.filename, conflicts);
+  } else if (c == 'r' || c == 'R') {
+    reloadRows(&t, base);
+    journalFree(&E.journal);
+    E.modified = false;
+    recoverRebase(&recovery, base, recoverSize(&recovery));
+    setMessage("Reloaded %s.", E.filename);
+  } else {
+    /** Ctrl-S will write over the version on disk **/
+    setKnown(base, t.hash, t.n, t.size > 0 && t.text[t.size - 1] == '\n');
+    resyncRecovery(&t);
+    setMessage("Kept your rows, %s on disk is newer.", E.filename);
+  }
+  freeLines(&t);
+}
+
+/**
+ * Toggles follow mode with CTRL-O, the cursor stays on
+ * the last line as the file grows on disk.
+ */ 
+void toggleFollow() {
+  watch.follow = !watch.follow;
+  if (watch.follow) {
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+    E.cx = 0;
+  }
+  setMessage(watch.follow ? "Following the end of the file." : "Follow off.");
+}
+
+
+/******************************************************************************
+*                                 Buffers                                     *
+******************************************************************************/
+
+/**
+ * Removes the watch of the buffer shown, unless another
+ * buffer has a file in the same directory: inotify gives
+ * them the same watch.
+ */ 
+void dropWatch() {
+  if (watch.wd == -1) return;
+  bool shared = false;
+  for (int i = 0; i < buffers.n; i++)
+    if (i != buffers.cur && buffers.list[i].watch.wd == watch.wd) shared = true;
+  if (!shared) inotify_rm_watch(events.inotify, watch.wd);
+  watch.wd = -1;
+}
+
+/**
+ * Keeps the buffer shown in its slot. Only the buffer
+ * shown flushes its recovery journal, hence it is
+ * written first.
+ */ 
+void stashBuffer() {
+  recoverFlush(&recovery);
+  struct buffer *b = &buffers.list[buffers.cur];
+  b->E = E;
+  b->watch = watch;
+  b->recovery = recovery;
+  b->wrap = wrap;
+}
+
+/**
+ * Shows a buffer, it is swapped into E. The terminal and
+ * window are the same for every buffer, they are kept.
+ * A change made on disk while it was hidden is checked.
+ * @param i is the buffer.
+ */ 
+void showBuffer(int i) {
+  struct buffer *b = &buffers.list[i];
+  struct termios terminal = E.terminal;
+  int screenrows = E.screenrows, screencols = E.screencols;
+  bool traceoverlay = E.traceoverlay;
+  E = b->E;
+  watch = b->watch;
+  recovery = b->recovery;
+  wrap = b->wrap;
+  E.terminal = terminal;
+  E.screenrows = screenrows;
+  E.screencols = screencols;
+  E.traceoverlay = traceoverlay;
+  buffers.cur = i;
+
+  invalidateScreen();
+  setMessage("Buffer %d of %d: %s", i + 1, buffers.n,
+    E.filename ? E.filename : "[No Name]");
+  if (watch.pending) {
+    watch.pending = false;
+    checkFile();
+  }
+}
+
+/**
+ * Shows the next or previous buffer, with CTRL-N and
+ * CTRL-A. Only pointers are copied, the rows stay where
+ * they are.
+ * @param step is 1 for the next buffer, -1 for the previous.
+ */ 
+void switchBuffer(int step) {
+  if (buffers.n < 2) {
+    setMessage("No other buffer is open.");
+    return;
+  }
+  /** A save writes the rows of the buffer shown **/
+  waitSave();
+  stashBuffer();
+  showBuffer((buffers.cur + step + buffers.n) % buffers.n);
+}
+
+/**
+ * Opens a file in a new buffer and shows it. Only the text
+ * of the file is loaded, the dictionary and the row
+ * allocator are the ones every buffer uses. A file that is
+ * open already is shown instead.
+ * @param filename is the file.
+ * @return true if a buffer was added.
+ */ 
+bool newBuffer(const char *filename) {
+  for (int i = 0; i < buffers.n; i++) {
+    const char *name = i == buffers.cur ? E.filename : buffers.list[i].E.filename;
+    if (name == NULL || strcmp(name, filename) != 0) continue;
+    if (i != buffers.cur) {
+      waitSave();
+      stashBuffer();
+      showBuffer(i);
+    }
+    return false;
+  }
+  if (buffers.n == buffers.cap) {
+    buffers.cap *= 2;
+    buffers.list = realloc(buffers.list, sizeof(struct buffer) * buffers.cap);
+    if (buffers.list == NULL) die("realloc");
+  }
+  waitSave();
+  stashBuffer();
+
+  struct termios terminal = E.terminal;
+  int screenrows = E.screenrows, screencols = E.screencols;
+  bool traceoverlay = E.traceoverlay;
+  memset(&E, 0, sizeof(E));
+  E.terminal = terminal;
+  E.screenrows = screenrows;
+  E.screencols = screencols;
+  E.traceoverlay = traceoverlay;
+  E.start = E.end = -1;
+  memset(&wrap, 0, sizeof(wrap));
+  watch = (struct watch) {.wd = -1};
+  recovery = (struct recovery) {.fd = -1};
+  buffers.cur = buffers.n++;
+
+  loadFile((char *) filename);
+  watchFile(filename);
+  recoverFile();
+  invalidateScreen();
+  if (!E.modified)
+    setMessage("Buffer %d of %d: %s", buffers.cur + 1, buffers.n, filename);
+  return true;
+}
+
+/**
+ * Prompts for a file to open in a new buffer, with CTRL-R.
+ */ 
+void openBuffer() {
+  char *filename = prompter();
+  if (filename[0] == '\0') setMessage("No file was opened.");
+  else newBuffer(filename);
+  free(filename);
+}
+
+/**
+ * Closes the buffer shown with CTRL-Q, asking to save it
+ * first. The editor quits with the last buffer.
+ */ 
+void closeBuffer() {
+  if (E.modified) saveQuit();
+  closeFile();
+  /** Kept only if the edits weren't saved or given up **/
+  recoverClose(&recovery, !E.modified);
+  if (buffers.n == 1) {
+    write(STDOUT_FILENO, CLEAR_SCREEN);
+    write(STDOUT_FILENO, HOME_CURSOR);
+    exit(0);
+  }
+
+  /** The rows went back to the pool, only the tables are left **/
+  dropWatch();
+  freeTable(&E.row);
+  free(E.filename);
+  free(wrap.count);
+  free(wrap.tree);
+  free(watch.name);
+  free(watch.hash);
+  free(recovery.buf);
+
+  int at = buffers.cur;
+  memmove(&buffers.list[at], &buffers.list[at + 1],
+    sizeof(struct buffer) * (buffers.n - at - 1));
+  buffers.n--;
+  showBuffer(at < buffers.n ? at : buffers.n - 1);
+}
+
+
+/******************************************************************************
+*                               Change Log                                    *
+******************************************************************************/
+
+/**
+ * Given a filename, creates its log filename, the
+ * extension is replaced by .log.
+ * @param filename is the file to be logged.
+ */ 
+char* changeLogFilename(char *filename) {
+  char *logfilename = malloc(strlen(filename) + 5);
+  strcpy(logfilename, filename);
+  /** Get rid of the extension, not of a dot in a directory **/
+  char *dot = strrchr(logfilename, '.');
+  char *slash = strrchr(logfilename, '/');
+  if (dot && dot != logfilename && (!slash || dot > slash + 1)) *dot = '\0';
+  strcat(logfilename,".log"); 
+  return logfilename;
+}
+
+/**
+ * Appends the saved rows to the change log of the file as
+ * a new revision. Only the lines changed since the previous
+ * revision are logged, compressed, see changelog.c.
+ * @param snap is the snapshot of the rows.
+ */ 
+void appendChangeLog(struct snapshot *snap){
+  /** For the current file, open its .log file **/
+  char *filename = changeLogFilename(snap->filename);
+  struct changeLog log;
+  if (logOpen(&log, filename, true) == 0) {
+    logAppend(&log, snap->chars, snap->size, snap->numrows, time(NULL));
+    logClose(&log);
+  }
+  free(filename);
 }
 
 /**
- * Given a file, opens the corresponding log.
+ * Given a file, opens the browser of its log. Only the
+ * index of the log is read, revisions are read when they
+ * are shown. Logs in the old format are loaded as they are.
  * @param filename is the file that the log belongs to.
  */ 
 void showChangeLog(char *filename) {
-    char *logfilename = changeLogFilename(filename);
+  char *logfilename = changeLogFilename(filename);
+  if (logOpen(&logview.log, logfilename, false) == -1) {
     loadFile(logfilename);
+    free(logfilename);
+    return;
+  }
+  free(logfilename);
+  logview.open = true;
+  logList();
+  /** Start on the latest revision **/
+  if (E.numrows > 0) E.cy = E.numrows - 1;
+}
+
+/**
+ * Replaces the rows with the revisions of the log, one
+ * per row, and goes back to where the list was left.
+ */ 
+void logList() {
+  struct changeLog *log = &logview.log;
+  closeFile();
+  char line[128];
+  for (int i = 0; i < log->n; i++) {
+    time_t t = log->rev[i].time;
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    int len = snprintf(line, sizeof(line), "%c revision %-6d %s  %8d lines  %s",
+      i == logview.mark ? '*' : ' ', i + 1, date, log->rev[i].lines,
+      log->rev[i].type == REC_CHECKPOINT ? "checkpoint" : "delta");
+    writeRow(E.numrows, line, len);
+  }
+  E.modified = false;
+  E.cy = logview.cy;
+  E.rowoff = logview.rowoff;
+  logview.view = LOG_LIST;
+  snprintf(logview.title, sizeof(logview.title), "%d revisions", log->n);
+  setMessage("Enter = VIEW | D = DIFF | M = MARK | Ctrl-Q = QUIT");
+}
+
+/**
+ * Reads a revision of the log and splits it into lines,
+ * hashed to be diffed.
+ * @param i is the revision.
+ * @param t is where the lines are kept.
+ * @return true if successful.
+ */ 
+bool readRevision(int i, struct textLines *t) {
+  size_t len;
+  memset(t, 0, sizeof(*t));
+  char *text = logRevision(&logview.log, i, &len);
+  return text != NULL && splitLines(t, text, len);
+}
+
+/**
+ * Replaces the rows with the text of a revision.
+ * @param i is the revision.
+ */ 
+void logShowRevision(int i) {
+  long long start = traceNow();
+  struct textLines t;
+  if (!readRevision(i, &t)) {
+    freeLines(&t);
+    setMessage("Revision %d can't be read", i + 1);
+    return;
+  }
+  if (logview.view == LOG_LIST) {
+    logview.cy = E.cy;
+    logview.rowoff = E.rowoff;
+  }
+  closeFile();
+  for (int j = 0; j < t.n; j++) writeRow(E.numrows, t.line[j], t.len[j]);
+  freeLines(&t);
+  E.modified = false;
+  logview.view = LOG_REVISION;
+  logview.from = -1;
+  logview.to = i;
+  snprintf(logview.title, sizeof(logview.title), "revision %d of %d",
+    i + 1, logview.log.n);
+  setMessage("Read in %.1f ms | N/P = NEXT/PREVIOUS | Esc = LIST",
+    (traceNow() - start) / 1e6);
+}
+
+/**
+ * Appends a line of the diff as a row, after its prefix.
+ */ 
+void diffRow(char prefix, const char *s, int len) {
+  static char *line;
+  static int cap;
+  if (len + 1 > cap) {
+    cap = len + 64;
+    line = realloc(line, cap);
+  }
+  line[0] = prefix;
+  memcpy(line + 1, s, len);
+  writeRow(E.numrows, line, len + 1);
+}
+
+/**
+ * Replaces the rows with a unified diff between two
+ * revisions, DIFF_CONTEXT lines of context around each
+ * change. Changes closer than twice that share a hunk.
+ * @param a is the old revision.
+ * @param b is the new revision.
+ */ 
+void logShowDiff(int a, int b) {
+  long long start = traceNow();
+  struct textLines x, y;
+  struct diffOp *ops = NULL;
+  bool ok = readRevision(a, &x);
+  ok = readRevision(b, &y) && ok;
+  struct diffText dx = linesText(&x), dy = linesText(&y);
+  int nops = ok ? diffLines(&dx, &dy, &ops) : -1;
+  if (nops == -1) {
+    freeLines(&x);
+    freeLines(&y);
+    setMessage("Revisions %d and %d can't be diffed", a + 1, b + 1);
+    return;
+  }
+  if (logview.view == LOG_LIST) {
+    logview.cy = E.cy;
+    logview.rowoff = E.rowoff;
+  }
+  closeFile();
+
+  char line[64];
+  int len = snprintf(line, sizeof(line), "--- revision %d", a + 1);
+  writeRow(E.numrows, line, len);
+  len = snprintf(line, sizeof(line), "+++ revision %d", b + 1);
+  writeRow(E.numrows, line, len);
+
+  int hunks = 0, added = 0, deleted = 0;
+  for (int i = 0; i < nops; i++) {
+    if (ops[i].type == DIFF_EQUAL) continue;
+    /** The hunk runs to the last change that is close enough **/
+    int j = i;
+    while (j + 1 < nops) {
+      if (ops[j + 1].type != DIFF_EQUAL) j++;
+      else if (j + 2 < nops && ops[j + 1].n <= 2 * DIFF_CONTEXT) j += 2;
+      else break;
+    }
+    int lead = i > 0 ? ops[i - 1].n : 0;
+    int trail = j + 1 < nops ? ops[j + 1].n : 0;
+    if (lead > DIFF_CONTEXT) lead = DIFF_CONTEXT;
+    if (trail > DIFF_CONTEXT) trail = DIFF_CONTEXT;
+
+    int a0 = ops[i].a - lead, b0 = ops[i].b - lead;
+    int a1 = ops[j].a + (ops[j].type != DIFF_INSERT ? ops[j].n : 0) + trail;
+    int b1 = ops[j].b + (ops[j].type != DIFF_DELETE ? ops[j].n : 0) + trail;
+    len = snprintf(line, sizeof(line), "@@ -%d,%d +%d,%d @@",
+      a1 > a0 ? a0 + 1 : a0, a1 - a0, b1 > b0 ? b0 + 1 : b0, b1 - b0);
+    writeRow(E.numrows, line, len);
+    hunks++;
+
+    for (int k = a0; k < ops[i].a; k++) diffRow(' ', x.line[k], x.len[k]);
+    for (int o = i; o <= j; o++) {
+      struct diffOp *op = &ops[o];
+      for (int k = 0; k < op->n; k++) {
+        if (op->type == DIFF_INSERT)
+          diffRow('+', y.line[op->b + k], y.len[op->b + k]);
+        else
+          diffRow(op->type == DIFF_DELETE ? '-' : ' ',
+            x.line[op->a + k], x.len[op->a + k]);
+      }
+      if (op->type == DIFF_INSERT) added += op->n;
+      if (op->type == DIFF_DELETE) deleted += op->n;
+    }
+    int end = a1 - trail;
+    for (int k = end; k < a1; k++) diffRow(' ', x.line[k], x.len[k]);
+    i = j;
+  }
+  free(ops);
+  freeLines(&x);
+  freeLines(&y);
+
+  E.modified = false;
+  logview.view = LOG_DIFF;
+  logview.from = a;
+  logview.to = b;
+  snprintf(logview.title, sizeof(logview.title), "revision %d to %d",
+    a + 1, b + 1);
+  setMessage("%d hunks, +%d -%d in %.1f ms | N/P = NEXT/PREVIOUS | Esc = LIST",
+    hunks, added, deleted, (traceNow() - start) / 1e6);
+}
+
+/**
+ * Handles the keys of the log browser. On the list Enter
+ * shows the revision under the cursor, M marks it and D
+ * diffs it against the marked one, or the one before it.
+ * A revision or diff steps with N and P, Esc goes back.
+ * @param c is the key.
+ * @return true if the key was handled, keys that would
+ * edit the rows are dropped.
+ */ 
+bool logKeypress(int c) {
+  int n = logview.log.n;
+  int at = E.cy < n ? E.cy : n - 1;
+  switch (c) {
+    case '\r':
+    case '\n':
+      if (logview.view == LOG_LIST && at >= 0) logShowRevision(at);
+      return true;
+    case 'm':
+    case 'M':
+      if (logview.view == LOG_LIST && at >= 0) {
+        logview.mark = logview.mark == at ? -1 : at;
+        logview.cy = E.cy;
+        logview.rowoff = E.rowoff;
+        logList();
+      }
+      return true;
+    case 'd':
+    case 'D':
+      if (logview.view != LOG_LIST || at < 0) return true;
+      if (logview.mark != -1 && logview.mark != at)
+        logShowDiff(logview.mark, at);
+      else if (at > 0)
+        logShowDiff(at - 1, at);
+      else
+        setMessage("The first revision has nothing to diff against");
+      return true;
+    case 'n':
+    case 'N':
+    case 'p':
+    case 'P': {
+      int step = (c == 'n' || c == 'N') ? 1 : -1;
+      int to = logview.to + step;
+      if (logview.view == LOG_LIST || to < 0 || to >= n) return true;
+      if (logview.view == LOG_REVISION) {
+        logShowRevision(to);
+      } else {
+        /** Both ends move, keeping the span of the diff **/
+        int from = logview.from + step;
+        if (from >= 0 && from < n) logShowDiff(from, to);
+      }
+      return true;
+    }
+    case ESC:
+    case BACKSPACE:
+      if (logview.view != LOG_LIST) logList();
+      return true;
+    case CTRL_KEY('q'):
+    case CTRL_KEY('x'):
+    case CTRL_KEY('g'):
+    case CTRL_KEY('l'):
+    case CTRL_KEY('t'):
+    case CTRL_KEY('b'):
+    case CTRL_KEY('e'):
+    case PAGE_UP:
+    case PAGE_DOWN:
+    case HOME_KEY:
+    case END_KEY:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case ARROW_UP:
+    case ARROW_DOWN:
+      return false;
+    default:
+      return true;
+  }
 }
 
 
@@ -1071,73 +4317,266 @@ void showChangeLog(char *filename) {
 #include "spell.h"
 
 /**
- * Iterates over each row of the buffer and sends
- * each to the spell checker one by one.
- * If there are misspellings, gets their start and 
- * end index then highlights and displays them on the 
- * screen.
+ * Builds the trie the first time words are checked in
+ * the editor. It is kept for every buffer.
  */ 
-void spellCheck() {
-  int totalmissed=0;
+void loadTrie() {
+  if (speller.loaded) return;
   if (loadDictionary() == 1) die ("Error loading dictionary. Please check README.");
+  speller.loaded = true;
+}
+
+/**
+ * Connects to the dictionary server, unless the trie was
+ * built already. A failed connect is a single syscall,
+ * hence a server started later is found.
+ * @return true if the server is connected.
+ */ 
+bool connectSpeller() {
+  if (speller.fd == -1 && !speller.loaded)
+    speller.fd = dictConnect(options.dictsocket);
+  return speller.fd != -1;
+}
+
+/**
+ * Drops the connection to a dictionary server that went
+ * away, words are checked in the editor from then on.
+ */ 
+void dropSpeller() {
+  close(speller.fd);
+  speller.fd = -1;
+}
+
+/**
+ * Highlights a misspelled word by rendering the entire
+ * row, the way the screen displays it.
+ * @param at is the row, start and end the word in it.
+ */ 
+void highlightMisspelling(int at, int start, int end) {
+  E.highlight = true;
+  E.start = start;
+  E.end = end;
+  renderRow(at);
+}
+
+/**
+ * Sends a batch of words to the dictionary server and
+ * highlights the ones it doesn't know.
+ * @param row, span are the row and place of each word.
+ * @return the number of misspelled words, -1 if the
+ * server is gone.
+ */ 
+int checkBatch(struct dictBatch *batch, int *row, struct misspelling *span) {
+  unsigned char known[DICT_BATCH / 8];
+  if (dictCheck(speller.fd, batch, known) == -1) {
+    dropSpeller();
+    return -1;
+  }
+  int missed = 0;
+  for (int k = 0; k < batch->n; k++) {
+    if (known[k / 8] & (1 << (k % 8))) continue;
+    highlightMisspelling(row[k], span[k].start, span[k].end);
+    missed++;
+  }
+  dictBatchReset(batch);
+  return missed;
+}
+
+/**
+ * Checks every word of the buffer through the dictionary
+ * server. The words of many rows go in one request, a
+ * batch costs a write and a read whatever its size.
+ * @return the number of misspelled words, -1 if the
+ * server can't be reached.
+ */ 
+int spellCheckServer() {
+  static struct dictBatch batch;
+  static int row[DICT_BATCH];
+  static struct misspelling span[DICT_BATCH];
+  struct misspelling *words = NULL;
+  int cap = 0, missed = 0, m = 0;
+  dictBatchReset(&batch);
+
+  for (int i = 0; i < E.numrows && m != -1; i++) {
+    /** A word takes at least two characters of the row **/
+    if (E.row.size[i] / 2 + 1 > cap) {
+      cap = E.row.size[i] / 2 + 1;
+      words = realloc(words, sizeof(struct misspelling) * cap);
+      if (words == NULL) die("realloc");
+    }
+    int n = spellWords(E.row.chars[i], E.row.size[i], words, cap);
+    for (int j = 0; j < n && m != -1; j++) {
+      if (batch.n == DICT_BATCH) {
+        m = checkBatch(&batch, row, span);
+        missed += m;
+      }
+      row[batch.n] = i;
+      span[batch.n] = words[j];
+      dictBatchAdd(&batch, E.row.chars[i] + words[j].start,
+        words[j].end - words[j].start);
+    }
+  }
+  if (m != -1) m = checkBatch(&batch, row, span);
+  free(words);
+  return m == -1 ? -1 : missed + m;
+}
 
+/**
+ * Checks every row of the buffer against the trie, in
+ * the editor.
+ * @return the number of misspelled words.
+ */ 
+int spellCheckLocal() {
+  int totalmissed = 0;
+  loadTrie();
   for (int i=0; i<E.numrows; i++) {
     /** Send each row of the buffer to the spell checker
      *  function**/
-    int miss = spellChecker(E.row[i].chars, E.row[i].size,0);
+    int miss = spellChecker(E.row.chars[i], E.row.size[i],0);
     totalmissed+=miss;
     for (int j=0; j<miss;j++) {
       /** For each misspelled word in the row, 
        * gets its start and end index on the row **/
-      E.highlight = true;
-      E.start = getMisspellings(j).start;
-      E.end = getMisspellings(j).end;
-
-      /** Highlights the misspelled words by 
-       * rendering the entire row and then 
-       * displays the row on the screen **/
-      renderRow(&E.row[i]);
+      highlightMisspelling(i, getMisspellings(j).start, getMisspellings(j).end);
     }
   }
+  return totalmissed;
+}
+
+/**
+ * Checks every word of the buffer when the user presses
+ * CTRL-F, and highlights the misspelled ones. A dictionary
+ * server is asked if one runs, it spares every editor
+ * building the trie. Otherwise the editor checks on its own.
+ */ 
+void spellCheck() {
+  long long start = traceNow();
+  int totalmissed = -1;
+  if (connectSpeller()) totalmissed = spellCheckServer();
+  if (totalmissed == -1) totalmissed = spellCheckLocal();
+  double ms = (traceNow() - start) / 1e6;
 
   if (totalmissed > 0)
-    setMessage("The misspelled words are highlighted. Found %d.", totalmissed);
+    setMessage("The misspelled words are highlighted. Found %d in %.1f ms.",
+      totalmissed, ms);
   else
-    setMessage("There were no misspelled words found.");
+    setMessage("There were no misspelled words found, checked in %.1f ms.", ms);
   
 
   /** Clean up **/
-  unloadDictionary();
   E.highlight = false;
   E.start = -1;
   E.end = -1;
 }
 
+/**
+ * Shows the words one edit away from the word under the
+ * cursor on the message bar, when the user presses CTRL-U.
+ */ 
+void suggestWord() {
+  if (E.cy >= E.numrows) return;
+  const char *s = E.row.chars[E.cy];
+  int a = E.cx, b = E.cx, size = E.row.size[E.cy];
+  while (a > 0 && (isalpha((unsigned char) s[a - 1]) || s[a - 1] == '\'')) a--;
+  while (b < size && (isalpha((unsigned char) s[b]) || s[b] == '\'')) b++;
+  if (a == b || b - a > LENGTH) {
+    setMessage("There is no word under the cursor.");
+    return;
+  }
+  char word[LENGTH + 1];
+  memcpy(word, s + a, b - a);
+  word[b - a] = '\0';
+
+  char out[DICT_SUGGESTIONS][LENGTH + 1];
+  int n = -1;
+  if (connectSpeller()) {
+    n = dictSuggest(speller.fd, word, out, DICT_SUGGESTIONS);
+    if (n == -1) dropSpeller();
+  }
+  if (n == -1) {
+    loadTrie();
+    n = suggest(word, out, DICT_SUGGESTIONS);
+  }
+
+  if (n == 0) {
+    setMessage("No suggestions for %s.", word);
+    return;
+  }
+  char msg[sizeof(E.statusmsg)];
+  int len = snprintf(msg, sizeof(msg), "%s:", word);
+  for (int i = 0; i < n && len < (int) sizeof(msg); i++)
+    len += snprintf(msg + len, sizeof(msg) - len, " %s", out[i]);
+  setMessage("%s", msg);
+}
+
 /**
  * Given a row, checks the wordType and accordingly
  * highlights misspelled words.
- * @param row is the row to be highlighted
+ * @param at is the index of the row to be highlighted
  */ 
-void highlightWords(rows *row) {
-  /** Allocate space to the highlighting field **/
-  row->hl = realloc(row->hl, row->rsize);
-
-  if (!E.highlight)
+void highlightWords(int at) {
+  unsigned char *hl = E.row.hl[at];
+  int rsize = renderedLength(at);
+  int start = E.row.rstart[at];
+
+  /** The highlighting field is allocated along with
+   * render by renderRow **/
+  if (!E.highlight) {
     /** If not in highlight mode, set to NORMAL **/
-    memset(row->hl, NORMAL, row->rsize);
+    memset(hl, NORMAL, rsize);
+    return;
+  }
 
-  for (int i = 0; i < row->rsize; i++) {
+  for (int i = 0; i < rsize; i++) {
     /** Iterate over the entire row and where
      * the misspelled word starts and ends, set 
      * to MISSPELLED **/
-    if (i >= E.start && i <= E.end) {
-      row->hl[i] = MISSPELLED;
+    if (i + start >= E.start && i + start <= E.end) {
+      hl[i] = MISSPELLED;
     }
   }
 }
 
 
 
+/******************************************************************************
+*                               Debugging                                     *
+******************************************************************************/
+
+/**
+ * Displays the row allocator counters on the message bar
+ * when the user presses CTRL-G. Text is the payload the rows
+ * actually need, in use is what the allocator handed out for
+ * it and reserved is what it holds from malloc. Frame is the
+ * number of bytes the last frame wrote to the terminal, the
+ * iovecs it was gathered from, the time taken to build it and
+ * the reallocations of the editing buffer that took.
+ */ 
+void memoryStats() {
+  struct poolStats *st = &pool.stats;
+  size_t text = 0;
+  for (int i = 0; i < E.numrows; i++)
+    text += E.row.size[i] + 1 + 2 * (renderedLength(i) + 1);
+  /** The pool holds the rows of every buffer **/
+  for (int b = 0; b < buffers.n; b++) {
+    if (b == buffers.cur) continue;
+    rows *r = &buffers.list[b].E.row;
+    for (int i = 0; i < buffers.list[b].E.numrows; i++)
+      text += r->size[i] + 1 + 2 * (tableRenderedLength(r, i) + 1);
+  }
+
+  /** Fragmentation is the share of reserved memory that
+   * isn't holding row text, none if the text fills it **/
+  double frag = st->reserved > text ?
+    100.0 * ((double) st->reserved - text) / st->reserved : 0.0;
+  setMessage("allocs %llu | live %zu | text %zu B | in use %zu B | "
+    "reserved %zu B in %zu slabs | frag %.1f%% | frame %d B %d iov "
+    "%lld us %d allocs", st->allocs, st->live, text, st->inuse, st->reserved,
+    st->slabs, frag, screen.bytes, screen.segments, screen.buildns / 1000,
+    screen.allocs);
+}
+
+
 /******************************************************************************
 *                          Key Input Processing                               *
 ******************************************************************************/
@@ -1152,6 +4591,8 @@ void die(const char *s) {
   write(STDOUT_FILENO, HOME_CURSOR);
   perror(s);
   write(STDOUT_FILENO, "\r\n", 3);
+  /** The edits can be recovered on the next start **/
+  recoverClose(&recovery, false);
   exit(1);
 }
 
@@ -1160,6 +4601,7 @@ void die(const char *s) {
  * attributes back.
  */ 
 void restoreTerminal() {
+  write(STDOUT_FILENO, PASTE_OFF);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.terminal) == -1)
     die("tcsetattr");
 }
@@ -1178,65 +4620,234 @@ void modifyTerminal() {
   struct termios newterminal = E.terminal;
   newterminal.c_iflag &= ~(BRKINT | ICRNL | IXON); /** input flags **/
   newterminal.c_lflag &= ~(ECHO | ICANON | ISIG); /** local flags **/
+  /** Reads never block, the editor waits with poll **/
   newterminal.c_cc[VMIN] = 0; /** control characters **/
-  newterminal.c_cc[VTIME] = 1;
+  newterminal.c_cc[VTIME] = 0;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &newterminal) == -1) die("tcsetattr");
 
+  /** Ask the terminal to mark pasted text **/
+  write(STDOUT_FILENO, PASTE_ON);
+
+}
+
+/**
+ * Waits on standard input, without looking at the
+ * bytes already buffered.
+ * @param timeout in milliseconds, -1 to wait forever.
+ * @return true if standard input is readable.
+ */ 
+bool waitInput(int timeout) {
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  int n = poll(&pfd, 1, timeout);
+  if (n == -1 && errno != EINTR) die("poll");
+  return n > 0;
+}
+
+/**
+ * Reads everything available on standard input into the
+ * ring buffer, with a single readv over its free space.
+ * @return the number of bytes read.
+ */ 
+int inputFill() {
+  int tail = (input.head + input.len) % INPUT_SIZE;
+  int free = INPUT_SIZE - input.len;
+  if (free == 0) return 0;
+
+  /** The free space may wrap around the end **/
+  struct iovec iov[2];
+  int first = INPUT_SIZE - tail < free ? INPUT_SIZE - tail : free;
+  iov[0].iov_base = &input.buf[tail];
+  iov[0].iov_len = first;
+  iov[1].iov_base = input.buf;
+  iov[1].iov_len = free - first;
+
+  ssize_t n = readv(STDIN_FILENO, iov, free > first ? 2 : 1);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EINTR) return 0;
+    die("read");
+  }
+  input.len += n;
+  return n;
+}
+
+/**
+ * Returns the byte at a position of the ring buffer.
+ * @param i is the position from the oldest byte.
+ * @return the byte, -1 if not read yet.
+ */ 
+int inputPeek(int i) {
+  if (i >= input.len) return -1;
+  return input.buf[(input.head + i) % INPUT_SIZE];
+}
+
+/**
+ * Drops bytes from the front of the ring buffer.
+ * @param n is the number of bytes.
+ */ 
+void inputConsume(int n) {
+  input.head = (input.head + n) % INPUT_SIZE;
+  input.len -= n;
+}
+
+/**
+ * Puts bytes back in front of the ring buffer, hence
+ * they are read again first.
+ * @param s is the bytes, len their number.
+ */ 
+void inputUnread(const char *s, int len) {
+  if (len > INPUT_SIZE - input.len) len = INPUT_SIZE - input.len;
+  for (int i = len - 1; i >= 0; i--) {
+    input.head = (input.head + INPUT_SIZE - 1) % INPUT_SIZE;
+    input.buf[input.head] = s[i];
+  }
+  input.len += len;
+}
+
+/**
+ * Reads bytes from standard input, the buffered ones
+ * come first.
+ * @param buf is where to read to, len its size.
+ * @return the number of bytes read, 0 if none, -1 on error.
+ */ 
+int readInput(char *buf, int len) {
+  if (input.len > 0) {
+    if (len > input.len) len = input.len;
+    for (int i = 0; i < len; i++) buf[i] = inputPeek(i);
+    inputConsume(len);
+    return len;
+  }
+  int nread = read(STDIN_FILENO, buf, len);
+  if (nread == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+  return nread;
+}
+
+/**
+ * Checks whether there is input to process, waiting for
+ * it up to a timeout.
+ * @param timeout in milliseconds, -1 to wait forever.
+ * @return true if a key can be read.
+ */ 
+bool inputPending(int timeout) {
+  if (input.len > 0) return true;
+  return waitInput(timeout);
+}
+
+/** Escape sequences, by introducer, final byte and number **/
+static const struct keySequence {
+  char kind;    /* '[' for CSI, 'O' for SS3 */
+  char final;   /* Final byte of the sequence */
+  int num;      /* First parameter, 0 if none */
+  int key;
+} keyTable[] = {
+  {'[', 'A', 0, ARROW_UP},     {'[', 'B', 0, ARROW_DOWN},
+  {'[', 'C', 0, ARROW_RIGHT},  {'[', 'D', 0, ARROW_LEFT},
+  {'[', 'H', 0, HOME_KEY},     {'[', 'F', 0, END_KEY},
+  {'O', 'A', 0, ARROW_UP},     {'O', 'B', 0, ARROW_DOWN},
+  {'O', 'C', 0, ARROW_RIGHT},  {'O', 'D', 0, ARROW_LEFT},
+  {'O', 'H', 0, HOME_KEY},     {'O', 'F', 0, END_KEY},
+  /** LINUX/RXVT CONSOLE **/
+  {'[', '~', 1, HOME_KEY},     {'[', '~', 7, HOME_KEY},
+  {'[', '~', 4, END_KEY},      {'[', '~', 8, END_KEY},
+  {'[', '~', 3, DEL_KEY},      {'[', '~', 5, PAGE_UP},
+  {'[', '~', 6, PAGE_DOWN},
+  /** Bracketed paste **/
+  {'[', '~', 200, PASTE_START},
+};
+
+/**
+ * Finds the length of the escape sequence at the front
+ * of the ring buffer. CSI sequences are ESC [ followed by
+ * parameter bytes and a final byte, SS3 ones ESC O and a byte.
+ * @return the length, 0 if incomplete, -1 if not a sequence.
+ */ 
+int sequenceLength() {
+  int kind = inputPeek(1);
+  if (kind == -1) return 0;
+  if (kind == 'O') return inputPeek(2) == -1 ? 0 : 3;
+  if (kind != '[') return -1;
+
+  for (int i = 2; i < 32; i++) {
+    int c = inputPeek(i);
+    if (c == -1) return 0;
+    if (c >= 0x40 && c <= 0x7e) return i + 1;
+    if (c < 0x20 || c > 0x3f) return -1;
+  }
+  return -1;
+}
+
+/**
+ * Decodes the escape sequence at the front of the ring
+ * buffer with the key table.
+ * @param len is the length of the sequence.
+ * @return the key with its modifiers, ESC if unknown.
+ */ 
+int decodeSequence(int len) {
+  int kind = inputPeek(1);
+  int final = inputPeek(len - 1);
+
+  /** Parameters are numbers separated by ; **/
+  int param[2] = {0, 0}, n = 0;
+  for (int i = 2; i < len - 1; i++) {
+    int c = inputPeek(i);
+    if (c >= '0' && c <= '9' && n < 2) param[n] = param[n] * 10 + c - '0';
+    else if (c == ';') n++;
+  }
+  inputConsume(len);
+
+  /** Letter keys carry a 1 before their modifier **/
+  int num = final == '~' ? param[0] : 0;
+  int mods = 0;
+  if (param[1] > 1) {
+    int m = param[1] - 1;
+    if (m & 1) mods |= KEY_SHIFT;
+    if (m & 2) mods |= KEY_ALT;
+    if (m & 4) mods |= KEY_CTRL;
+  }
+
+  for (size_t i = 0; i < sizeof(keyTable) / sizeof(keyTable[0]); i++) {
+    if (keyTable[i].kind == kind && keyTable[i].final == final 
+      && keyTable[i].num == num)
+      return keyTable[i].key | mods;
+  }
+  return ESC;
 }
 
 /**
- * Waits on standard input until a byte is read from
+ * Waits on standard input until a key is read from
  * the user. This is called from processKeypresses, hence
- * every input is processed immediately.
- * @return the read character from stdin.
+ * every input is processed immediately. Bytes are taken
+ * from the ring buffer, which is filled with everything
+ * available at once.
+ * @return the read character from stdin, or the key.
  */ 
 int readKey() {
-  int nread;
-  char c;
   /** Loop until there is a valid byte to read from stdin **/
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
-  /** Deal with escape sequences/control keys **/
-  if (c == ESC) {
-    char seq[3]; // space to read the rest of the control key
-
-    /** Try to read 2 bytes, individually, into seq**/
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return ESC;
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return ESC;
-
-    /** Deal with two types of sequences e.g. ^[0~ and ^[A **/
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return ESC;
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            /** LINUX/RXVT CONSOLE **/
-            case '3': return DEL_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-
-          }
-        }
-      } else {
-        switch (seq[1]) {
-            /** FREEBSD CONSOLE **/
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-
-        }
-      }
-    } 
+  while (input.len == 0) {
+    if (waitInput(-1)) inputFill();
+  }
 
-    return ESC;
-  } else {
+  int c = inputPeek(0);
+  if (c != ESC) {
     /** If not a control character, return read 
      * literal byte **/
-    return c; 
+    inputConsume(1);
+    return c;
+  }
+
+  /** Deal with escape sequences/control keys. A lone ESC
+   *  is told apart by waiting a little for the rest **/
+  int len;
+  while ((len = sequenceLength()) == 0 && waitInput(options.escms))
+    inputFill();
 
+  if (len > 0) return decodeSequence(len);
+  if (len == 0) {
+    /** Incomplete, drop what arrived of it **/
+    inputConsume(input.len);
+  } else {
+    inputConsume(1);
   }
+  return ESC;
 }
 
 
@@ -1246,16 +4857,18 @@ int readKey() {
  * user requests
  * */
 void processKeypress() {
+  long long t = traceNow();
   int c = readKey();
+  traceEnd(TRACE_READ, t);
+  int mods = c & KEY_MODS;
+  int sub;
+  c &= ~KEY_MODS;
+  /** The log browser is read only and has keys of its own **/
+  if (logview.open && logKeypress(c)) return;
 
   switch (c) {  
     case CTRL_KEY('q'):
-      if (E.modified){
-        saveQuit();
-      }
-      write(STDOUT_FILENO, CLEAR_SCREEN);
-      write(STDOUT_FILENO, HOME_CURSOR);
-      exit(0);
+      closeBuffer();
       break;
     case CTRL_KEY('x'):
       setMessage("Ctrl-Q = QUIT | Ctrl-X = HELP | Ctrl-S = SAVE | Ctrl-F = SPELLCHECK | Ctrl-C = COPY FILE | Ctrl-D = DELETE FILE");
@@ -1275,8 +4888,53 @@ void processKeypress() {
     case CTRL_KEY('d'):
       deleteFile();
       break;
+    case CTRL_KEY('g'):
+      memoryStats();
+      break;
+    case CTRL_KEY('z'):
+      undo();
+      break;
+    case CTRL_KEY('y'):
+      redo();
+      break;
+    case CTRL_KEY('b'):
+      toggleMark();
+      break;
+    case CTRL_KEY('w'):
+      copySelection(true);
+      break;
+    case CTRL_KEY('e'):
+      copySelection(false);
+      break;
+    case CTRL_KEY('p'):
+      paste();
+      break;
+    case CTRL_KEY('l'):
+      toggleWrap();
+      break;
+    case CTRL_KEY('t'):
+      toggleTrace();
+      break;
+    case CTRL_KEY('o'):
+      toggleFollow();
+      break;
+    case CTRL_KEY('r'):
+      openBuffer();
+      break;
+    case CTRL_KEY('n'):
+      switchBuffer(1);
+      break;
+    case CTRL_KEY('a'):
+      switchBuffer(-1);
+      break;
+    case CTRL_KEY('u'):
+      suggestWord();
+      break;
     case ESC:
       break;
+    case PASTE_START:
+      pasteInput();
+      break;
     case '\r':
     case '\n':
       insertNewline();
@@ -1291,21 +4949,39 @@ void processKeypress() {
          *  position to simulate movement of page
          *  to that position **/
         E.cy = E.rowoff;
+        if (E.softwrap) E.cy = visualRow(E.rowoff, &sub);
         break;
     case PAGE_DOWN:
         /** set vertical index of cursor to bottom
          *  of page and never out of the window **/
         E.cy = E.rowoff + E.screenrows - 1;
+        if (E.softwrap) E.cy = visualRow(E.cy, &sub);
         if (E.cy > E.numrows) E.cy = E.numrows;
         break;
-    case ARROW_UP:
-    case ARROW_DOWN:
+    case HOME_KEY:
+      /** Ctrl-Home goes to the start of the file **/
+      if (mods & KEY_CTRL) E.cy = 0;
+      E.cx = 0;
+      break;
+    case END_KEY:
+      if (mods & KEY_CTRL) E.cy = E.numrows;
+      E.cx = E.cy < E.numrows ? E.row.size[E.cy] : 0;
+      break;
     case ARROW_LEFT:
     case ARROW_RIGHT:
+      if (mods & (KEY_CTRL | KEY_ALT)) {
+        moveWord(c);
+        break;
+      }
+      moveCursor(c);
+      break;
+    case ARROW_UP:
+    case ARROW_DOWN:
       moveCursor(c);
       break;
     default:
-      insertChar(c);
+      /** Keys without an action aren't text **/
+      if (c < 1000) insertChar(c);
       break;
   }
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include "journal.h"
+
+/** Chunks of the journal, ops are bump allocated in them **/
+typedef struct chunk {
+    struct chunk *prev;
+    size_t used, cap;
+    char data[];
+} chunk;
+
+#define CHUNK_SIZE (64 * 1024)
+
+/** Bytes an op with len bytes of text takes in a chunk **/
+static size_t opSize(int len)
+{
+    return (sizeof(op) + len + 7) & ~(size_t) 7;
+}
+
+/**
+ * Drops every op recorded after the current one, their
+ * memory is handed back to the bump allocator.
+ */
+static void truncate(struct journal *j)
+{
+    if (j->cur == j->last)
+        return;
+
+    chunk *keep = j->cur ? j->cur->chunk : NULL;
+    while (j->chunks != keep) {
+        chunk *c = j->chunks;
+        j->chunks = c->prev;
+        j->bytes -= c->cap;
+        free(c);
+    }
+
+    if (keep) {
+        keep->used = (char *) j->cur + opSize(j->cur->len) - keep->data;
+        j->cur->next = NULL;
+    } else {
+        j->first = NULL;
+    }
+    j->last = j->cur;
+}
+
+/**
+ * Records an operation at the end of the journal. Undone
+ * operations can't be redone once a new one is recorded.
+ * @param type is the type of the operation.
+ * @param y, x is the position of the operation.
+ * @param text is the text inserted or deleted, len its length.
+ * @param flags are the op flags.
+ * @return the recorded op, NULL if out of memory.
+ */
+op *journalRecord(struct journal *j, int type, int y, int x,
+    const char *text, int len, int flags)
+{
+    truncate(j);
+
+    /** Take a new chunk if the op doesn't fit **/
+    size_t size = opSize(len);
+    chunk *c = j->chunks;
+    if (c == NULL || c->used + size > c->cap) {
+        size_t cap = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        c = malloc(sizeof(chunk) + cap);
+        if (c == NULL)
+            return NULL;
+        c->prev = j->chunks;
+        c->used = 0;
+        c->cap = cap;
+        j->chunks = c;
+        j->bytes += cap;
+    }
+
+    op *o = (op *) (c->data + c->used);
+    c->used += size;
+    o->chunk = c;
+    o->type = type;
+    o->flags = flags;
+    o->y = y;
+    o->x = x;
+    o->len = len;
+    if (len > 0)
+        memcpy(o->text, text, len);
+
+    /** Link it after the newest op **/
+    o->prev = j->last;
+    o->next = NULL;
+    if (j->last)
+        j->last->next = o;
+    else
+        j->first = o;
+    j->last = j->cur = o;
+    return o;
+}
+
+/**
+ * Grows the text of the newest op in place. Only possible
+ * when it is the last thing in its chunk and wasn't undone.
+ * @param text is the text to append, len its length.
+ * @return true if the op was extended.
+ */
+bool journalExtend(struct journal *j, const char *text, int len)
+{
+    op *o = j->last;
+    if (o == NULL || o != j->cur || o->chunk != j->chunks)
+        return false;
+
+    chunk *c = o->chunk;
+    size_t start = (char *) o - c->data;
+    if (start + opSize(o->len + len) > c->cap)
+        return false;
+
+    memcpy(o->text + o->len, text, len);
+    o->len += len;
+    c->used = start + opSize(o->len);
+    return true;
+}
+
+/**
+ * Steps back over the current op.
+ * @return the op to be undone, NULL if there is none.
+ */
+op *journalUndo(struct journal *j)
+{
+    op *o = j->cur;
+    if (o)
+        j->cur = o->prev;
+    return o;
+}
+
+/**
+ * Steps forward over the next undone op.
+ * @return the op to be redone, NULL if there is none.
+ */
+op *journalRedo(struct journal *j)
+{
+    /** With nothing applied, the next op is the oldest one **/
+    op *o = j->cur ? j->cur->next : j->first;
+    if (o)
+        j->cur = o;
+    return o;
+}
+
+/**
+ * Frees every chunk of the journal.
+ */
+void journalFree(struct journal *j)
+{
+    while (j->chunks) {
+        chunk *c = j->chunks;
+        j->chunks = c->prev;
+        free(c);
+    }
+    memset(j, 0, sizeof(*j));
+}
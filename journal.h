@@ -0,0 +1,57 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Types of recorded edit operations **/
+enum opType {
+    OP_INSERT = 1,  /* text inserted at y,x, may contain newlines */
+    OP_DELETE,      /* text deleted at y,x, may contain newlines */
+    OP_ADDROW,      /* row y inserted with text */
+    OP_DELROW,      /* row y removed, text was its contents */
+    OP_UNLINK       /* the file was deleted from disk */
+};
+
+/** Operation flags **/
+#define OP_CHAIN 1  /* undone and redone along with the previous op */
+
+/** A single recorded operation, followed by its text **/
+typedef struct op {
+    struct op *prev, *next;  /* Neighbours in the journal */
+    void *chunk;             /* Chunk the op lives in */
+    int y, x;                /* Position of the operation */
+    int len;                 /* Length of text */
+    unsigned char type;
+    unsigned char flags;
+    char text[];
+} op;
+
+/** The undo/redo journal. Operations are bump allocated
+ * in chunks, so memory is proportional to the edited bytes. **/
+struct journal {
+    void *chunks;   /* Newest chunk */
+    op *first;      /* Oldest recorded op */
+    op *last;       /* Newest recorded op */
+    op *cur;        /* Newest applied op, NULL if all are undone */
+    size_t bytes;   /* Bytes held by the chunks */
+};
+
+/** Records an operation, dropping every undone op after the
+ * current one. Returns the op, or NULL if out of memory. **/
+op *journalRecord(struct journal *j, int type, int y, int x,
+    const char *text, int len, int flags);
+
+/** Appends text to the newest op if it is at the end of the
+ * journal and was not undone. Returns true if successful. **/
+bool journalExtend(struct journal *j, const char *text, int len);
+
+/** Returns the op to undo and steps back, NULL if none **/
+op *journalUndo(struct journal *j);
+
+/** Returns the op to redo and steps forward, NULL if none **/
+op *journalRedo(struct journal *j);
+
+/** Frees every recorded operation **/
+void journalFree(struct journal *j);
+
+#endif
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+/** Header at the head of every slab **/
+typedef struct slab {
+    struct slab *next;
+    char pad[8];        /* keep blocks 16 byte aligned */
+} slab;
+
+/** Header in front of every large block **/
+typedef struct large {
+    struct large *prev, *next;
+    size_t size;
+    char pad[8];
+} large;
+
+/** Large blocks are rounded to this granularity **/
+#define LARGE_STEP 4096
+
+/**
+ * Given a requested size, finds its size class.
+ * @param size is the number of bytes requested.
+ * @return the index of the class, or -1 for a large block.
+ */
+static int sizeClass(size_t size)
+{
+    if (size > ((size_t) 1 << POOL_MAX_SHIFT))
+        return -1;
+
+    int c = 0;
+    while (((size_t) 1 << (c + POOL_MIN_SHIFT)) < size)
+        c++;
+    return c;
+}
+
+/**
+ * Given a requested size, returns the usable capacity
+ * of the block that will be handed out for it.
+ * @param size is the number of bytes requested.
+ */
+size_t poolCapacity(size_t size)
+{
+    int c = sizeClass(size);
+    if (c == -1)
+        return (size + LARGE_STEP - 1) / LARGE_STEP * LARGE_STEP;
+    return (size_t) 1 << (c + POOL_MIN_SHIFT);
+}
+
+/**
+ * Takes a fresh slab from malloc and makes it the bump
+ * region of a size class.
+ * @return 0 if successful, 1 otherwise.
+ */
+static int newSlab(struct pool *pool, int c)
+{
+    slab *s = malloc(SLAB_SIZE);
+    if (s == NULL)
+        return 1;
+
+    s->next = pool->slabs;
+    pool->slabs = s;
+    pool->bump[c] = (char *) (s + 1);
+    pool->limit[c] = (char *) s + SLAB_SIZE;
+    pool->stats.slabs++;
+    pool->stats.reserved += SLAB_SIZE;
+    return 0;
+}
+
+/**
+ * Hands out a block of at least size bytes. Small blocks are
+ * taken from the free list of their class, or carved from the
+ * newest slab of that class.
+ * @param size is the number of bytes requested.
+ * @return the block, NULL if out of memory.
+ */
+void *poolAlloc(struct pool *pool, size_t size)
+{
+    int c = sizeClass(size);
+    size_t cap = poolCapacity(size);
+    void *p;
+
+    if (c == -1) {
+        /** Large blocks are kept on a list for bulk release **/
+        large *l = malloc(sizeof(large) + cap);
+        if (l == NULL)
+            return NULL;
+        l->size = cap;
+        l->prev = NULL;
+        l->next = pool->large;
+        if (l->next)
+            l->next->prev = l;
+        pool->large = l;
+        pool->stats.reserved += cap;
+        p = l + 1;
+    } else if (pool->freelist[c]) {
+        /** Reuse a freed block of the same class **/
+        p = pool->freelist[c];
+        pool->freelist[c] = *(void **) p;
+    } else {
+        /** Carve a block from the slab **/
+        if (pool->bump[c] == NULL || pool->bump[c] + cap > pool->limit[c])
+            if (newSlab(pool, c))
+                return NULL;
+        p = pool->bump[c];
+        pool->bump[c] += cap;
+    }
+
+    pool->stats.allocs++;
+    pool->stats.live++;
+    pool->stats.inuse += cap;
+    return p;
+}
+
+/**
+ * Gives a block back to the pool. Small blocks go onto the
+ * free list of their class, large blocks back to malloc.
+ * @param p is the block, may be NULL.
+ * @param cap is the capacity of the block.
+ */
+void poolFree(struct pool *pool, void *p, size_t cap)
+{
+    if (p == NULL)
+        return;
+
+    int c = sizeClass(cap);
+    if (c == -1) {
+        large *l = (large *) p - 1;
+        if (l->prev)
+            l->prev->next = l->next;
+        else
+            pool->large = l->next;
+        if (l->next)
+            l->next->prev = l->prev;
+        pool->stats.reserved -= l->size;
+        free(l);
+    } else {
+        *(void **) p = pool->freelist[c];
+        pool->freelist[c] = p;
+    }
+
+    pool->stats.frees++;
+    pool->stats.live--;
+    pool->stats.inuse -= cap;
+}
+
+/**
+ * Moves a block to one that can hold size bytes. If the
+ * capacity doesn't change, the same block is returned.
+ * @param p is the block, may be NULL.
+ * @param cap is the capacity of the block.
+ * @param size is the number of bytes now needed.
+ * @return the new block, NULL if out of memory.
+ */
+void *poolRealloc(struct pool *pool, void *p, size_t cap, size_t size)
+{
+    if (p != NULL && poolCapacity(size) == cap)
+        return p;
+
+    /** Large blocks can be grown in place by realloc **/
+    if (p != NULL && sizeClass(cap) == -1 && sizeClass(size) == -1) {
+        large *l = (large *) p - 1;
+        size_t newcap = poolCapacity(size);
+        large *n = realloc(l, sizeof(large) + newcap);
+        if (n == NULL)
+            return NULL;
+        if (n->prev)
+            n->prev->next = n;
+        else
+            pool->large = n;
+        if (n->next)
+            n->next->prev = n;
+        n->size = newcap;
+        pool->stats.reserved += newcap - cap;
+        pool->stats.inuse += newcap - cap;
+        pool->stats.allocs++;
+        return n + 1;
+    }
+
+    void *new = poolAlloc(pool, size);
+    if (new == NULL)
+        return NULL;
+    if (p != NULL) {
+        memcpy(new, p, cap < size ? cap : size);
+        poolFree(pool, p, cap);
+    }
+    return new;
+}
+
+/**
+ * Releases every slab and large block of the pool in one
+ * pass, without visiting the blocks handed out.
+ */
+void poolRelease(struct pool *pool)
+{
+    slab *s = pool->slabs;
+    while (s) {
+        slab *next = s->next;
+        free(s);
+        s = next;
+    }
+
+    large *l = pool->large;
+    while (l) {
+        large *next = l->next;
+        free(l);
+        l = next;
+    }
+
+    /** Keep the lifetime allocation count **/
+    unsigned long long allocs = pool->stats.allocs;
+    unsigned long long frees = pool->stats.frees;
+    memset(pool, 0, sizeof(*pool));
+    pool->stats.allocs = allocs;
+    pool->stats.frees = frees;
+}
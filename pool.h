@@ -0,0 +1,50 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+
+/** smallest and largest slab size class, as powers of two **/
+#define POOL_MIN_SHIFT 4
+#define POOL_MAX_SHIFT 12
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+/** Every slab is carved into blocks of a single size class **/
+#define SLAB_SIZE (64 * 1024)
+
+/** Allocation counters, shown by the editor's debug command **/
+struct poolStats {
+    unsigned long long allocs;  /* Total number of allocations made */
+    unsigned long long frees;   /* Total number of blocks given back */
+    size_t live;                /* Blocks currently handed out */
+    size_t inuse;               /* Capacity of the blocks handed out */
+    size_t reserved;            /* Bytes held from malloc: slabs + large blocks */
+    size_t slabs;               /* Number of slabs held */
+};
+
+/** A size-class slab allocator for row payloads. Blocks up to
+ * 2^POOL_MAX_SHIFT bytes come from slabs, larger ones from malloc. **/
+struct pool {
+    void *freelist[POOL_CLASSES];  /* Free blocks of each size class */
+    char *bump[POOL_CLASSES];      /* Next untouched block in the newest slab */
+    char *limit[POOL_CLASSES];     /* End of the newest slab */
+    void *slabs;                   /* Linked list of every slab */
+    void *large;                   /* Linked list of large blocks */
+    struct poolStats stats;
+};
+
+/** Returns the usable capacity of a block requested with size bytes **/
+size_t poolCapacity(size_t size);
+
+/** Returns a block of at least size bytes, or NULL **/
+void *poolAlloc(struct pool *pool, size_t size);
+
+/** Grows or shrinks a block of capacity cap to hold size bytes.
+ * The contents are kept, the old block must not be used again. **/
+void *poolRealloc(struct pool *pool, void *p, size_t cap, size_t size);
+
+/** Gives a block of capacity cap back to the pool **/
+void poolFree(struct pool *pool, void *p, size_t cap);
+
+/** Releases every block of the pool at once **/
+void poolRelease(struct pool *pool);
+
+#endif
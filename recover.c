@@ -0,0 +1,308 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "recover.h"
+
+/**
+ * The journal is a header naming the version of the file the
+ * edits apply to, then the edits in the order they were made:
+ *
+ *   "EDREC1\n", size i64, mtime i64
+ *   record:  type u8, y i32, x i32, len i32, text
+ *
+ * It is only appended to. A record torn by a crash ends it.
+ */
+#define RECOVER_MAGIC "EDREC1\n"
+#define RECOVER_MAGIC_LEN 7
+#define RECOVER_HEADER (RECOVER_MAGIC_LEN + 16)
+#define RECORD_SIZE 13
+
+/**
+ * Writes all len bytes of buf.
+ * @return 0 if successful, -1 on error.
+ */
+static int writeFull(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void packBase(unsigned char *b, const struct recoverBase *base)
+{
+    memcpy(b, RECOVER_MAGIC, RECOVER_MAGIC_LEN);
+    memcpy(b + RECOVER_MAGIC_LEN, &base->size, 8);
+    memcpy(b + RECOVER_MAGIC_LEN + 8, &base->mtime, 8);
+}
+
+/**
+ * Opens the journal for appending, it is created with its
+ * header if it doesn't exist.
+ * @return 0 if successful, -1 otherwise.
+ */
+static int openJournal(struct recovery *r)
+{
+    r->fd = open(r->path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (r->fd != -1) {
+        unsigned char header[RECOVER_HEADER];
+        packBase(header, &r->base);
+        if (writeFull(r->fd, header, RECOVER_HEADER) == -1) {
+            close(r->fd);
+            unlink(r->path);
+            r->fd = -1;
+            return -1;
+        }
+        return 0;
+    }
+    /** A journal that was replayed is carried on **/
+    if (errno == EEXIST)
+        r->fd = open(r->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    return r->fd == -1 ? -1 : 0;
+}
+
+void recoverInit(struct recovery *r, const char *path,
+    struct recoverBase base)
+{
+    recoverClose(r, false);
+    r->path = strdup(path);
+    r->fd = -1;
+    r->base = base;
+    r->len = r->last = 0;
+    r->written = 0;
+    r->since = r->at = 0;
+
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size > RECOVER_HEADER)
+        r->written = st.st_size - RECOVER_HEADER;
+}
+
+/**
+ * Buffers a record. An insert right after the text of the
+ * newest buffered insert, both without newlines, extends it.
+ * @param now is the time in ms, for the flush deadlines.
+ * @return 0 if successful, -1 if out of memory or the
+ * journal can't be created.
+ */
+int recoverRecord(struct recovery *r, int type, int y, int x,
+    const char *text, int len, long long now)
+{
+    if (r->path == NULL)
+        return 0;
+    if (r->fd == -1 && openJournal(r) == -1)
+        return -1;
+
+    if (r->len + RECORD_SIZE + len > r->cap) {
+        size_t cap = r->cap ? r->cap : RECOVER_BUFFER;
+        while (cap < r->len + RECORD_SIZE + len)
+            cap *= 2;
+        char *buf = realloc(r->buf, cap);
+        if (buf == NULL)
+            return -1;
+        r->buf = buf;
+        r->cap = cap;
+    }
+
+    if (r->len > 0 && type == OP_INSERT && r->buf[r->last] == OP_INSERT
+        && !memchr(text, '\n', len)) {
+        int32_t ly, lx, llen;
+        char *rec = r->buf + r->last;
+        memcpy(&ly, rec + 1, 4);
+        memcpy(&lx, rec + 5, 4);
+        memcpy(&llen, rec + 9, 4);
+        if (ly == y && lx + llen == x && !memchr(rec + RECORD_SIZE, '\n', llen)) {
+            memcpy(r->buf + r->len, text, len);
+            r->len += len;
+            llen += len;
+            memcpy(rec + 9, &llen, 4);
+            r->at = now;
+            return 0;
+        }
+    }
+
+    char *rec = r->buf + r->len;
+    int32_t v;
+    rec[0] = type;
+    v = y;
+    memcpy(rec + 1, &v, 4);
+    v = x;
+    memcpy(rec + 5, &v, 4);
+    v = len;
+    memcpy(rec + 9, &v, 4);
+    memcpy(rec + RECORD_SIZE, text, len);
+    if (r->len == 0)
+        r->since = now;
+    r->last = r->len;
+    r->len += RECORD_SIZE + len;
+    r->at = now;
+
+    if (r->len >= RECOVER_BUFFER)
+        return recoverFlush(r);
+    return 0;
+}
+
+int recoverFlush(struct recovery *r)
+{
+    if (r->len == 0 || r->fd == -1)
+        return 0;
+    if (writeFull(r->fd, r->buf, r->len) == -1)
+        return -1;
+    r->written += r->len;
+    r->len = r->last = 0;
+    return 0;
+}
+
+long long recoverSize(struct recovery *r)
+{
+    return r->written + r->len;
+}
+
+/**
+ * Rewrites the journal against a new base. Records up to from
+ * are in the saved file, the ones past it are kept, copied
+ * into a new journal that replaces the old one.
+ */
+int recoverRebase(struct recovery *r, struct recoverBase base,
+    long long from)
+{
+    if (r->path == NULL)
+        return 0;
+    if (recoverFlush(r) == -1)
+        return -1;
+    r->base = base;
+    /** A replayed journal isn't open until the next record **/
+    if (r->fd == -1 && r->written == 0)
+        return 0;
+
+    long long keep = r->written - from;
+    if (keep <= 0) {
+        if (r->fd != -1)
+            close(r->fd);
+        r->fd = -1;
+        r->written = 0;
+        return unlink(r->path);
+    }
+
+    char *tail = malloc(keep);
+    size_t tmplen = strlen(r->path) + 5;
+    char *tmp = malloc(tmplen);
+    int in = open(r->path, O_RDONLY | O_CLOEXEC);
+    int ok = tail && tmp && in != -1
+        && pread(in, tail, keep, RECOVER_HEADER + from) == keep;
+    if (in != -1)
+        close(in);
+
+    int out = -1;
+    if (ok) {
+        snprintf(tmp, tmplen, "%s.new", r->path);
+        out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        unsigned char header[RECOVER_HEADER];
+        packBase(header, &base);
+        ok = out != -1 && writeFull(out, header, RECOVER_HEADER) == 0
+            && writeFull(out, tail, keep) == 0 && rename(tmp, r->path) == 0;
+        if (!ok && out != -1) {
+            close(out);
+            unlink(tmp);
+            out = -1;
+        }
+    }
+    free(tail);
+    free(tmp);
+    if (!ok)
+        return -1;
+
+    if (r->fd != -1)
+        close(r->fd);
+    r->fd = out;
+    r->written = keep;
+    return 0;
+}
+
+/**
+ * Runs in a signal handler, hence the buffer, which the
+ * interrupted code may be changing, is left alone. Only the
+ * descriptor is read and fdatasync is safe to call.
+ */
+void recoverEmergency(struct recovery *r)
+{
+    int fd = r->fd;
+    if (fd != -1)
+        fdatasync(fd);
+}
+
+void recoverClose(struct recovery *r, bool discard)
+{
+    if (r->path == NULL)
+        return;
+    if (discard) {
+        r->len = 0;
+        unlink(r->path);
+    }
+    recoverFlush(r);
+    if (r->fd != -1)
+        close(r->fd);
+    r->fd = -1;
+    free(r->path);
+    r->path = NULL;
+}
+
+/**
+ * Maps the journal and hands every whole record to apply.
+ */
+long long recoverReplay(const char *path, const struct recoverBase *base,
+    recoverApply apply, void *arg)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < RECOVER_HEADER) {
+        close(fd);
+        return -1;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    unsigned char header[RECOVER_HEADER];
+    packBase(header, base);
+    if (memcmp(map, header, RECOVER_HEADER) != 0) {
+        int other = memcmp(map, RECOVER_MAGIC, RECOVER_MAGIC_LEN) == 0;
+        munmap((void *) map, st.st_size);
+        return other ? -2 : -1;
+    }
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+    long long n = 0;
+    const char *p = map + RECOVER_HEADER, *end = map + st.st_size;
+    while (end - p >= RECORD_SIZE) {
+        int32_t y, x, len;
+        memcpy(&y, p + 1, 4);
+        memcpy(&x, p + 5, 4);
+        memcpy(&len, p + 9, 4);
+        if (len < 0 || end - p - RECORD_SIZE < len)
+            break;
+        if (apply && !apply(p[0], y, x, p + RECORD_SIZE, len, arg))
+            break;
+        p += RECORD_SIZE + len;
+        n++;
+    }
+    munmap((void *) map, st.st_size);
+    return n;
+}
@@ -0,0 +1,72 @@
+#ifndef RECOVER_H
+#define RECOVER_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Buffered records past this many bytes are written at once **/
+#define RECOVER_BUFFER (64 << 10)
+
+/** The file a recovery journal applies to, as it was on disk **/
+struct recoverBase {
+    long long size;     /* -1 if the file didn't exist */
+    long long mtime;    /* Modification time in ns */
+};
+
+/** The recovery journal of a file. Edits are buffered in memory
+ * and written by recoverFlush, the file is created with the
+ * first record. **/
+struct recovery {
+    char *path;             /* NULL if edits aren't journaled */
+    int fd;                 /* -1 until the first record */
+    struct recoverBase base;
+    char *buf;              /* Records not written yet */
+    size_t len, cap;
+    size_t last;            /* Offset of the newest buffered record */
+    long long written;      /* Bytes of records in the file */
+    long long since;        /* When the oldest buffered record came, ms */
+    long long at;           /* When the newest one came, ms */
+};
+
+/** Called for every replayed record, returns false to stop **/
+typedef bool (*recoverApply)(int type, int y, int x, const char *text,
+    int len, void *arg);
+
+/** Starts journaling the edits of a file to path. A journal
+ * already at path is appended to. **/
+void recoverInit(struct recovery *r, const char *path,
+    struct recoverBase base);
+
+/** Buffers an edit. Typing is merged into the previous record.
+ * Returns 0 if successful, -1 otherwise. **/
+int recoverRecord(struct recovery *r, int type, int y, int x,
+    const char *text, int len, long long now);
+
+/** Writes the buffered records. Returns 0 if successful, -1
+ * otherwise, the records are kept to be written again. **/
+int recoverFlush(struct recovery *r);
+
+/** Returns the bytes of records journaled so far **/
+long long recoverSize(struct recovery *r);
+
+/** The file was saved as base: keeps only the records journaled
+ * past offset from, or removes the journal if there are none.
+ * Returns 0 if successful, -1 otherwise. **/
+int recoverRebase(struct recovery *r, struct recoverBase base,
+    long long from);
+
+/** Syncs the records written so far, from a signal handler.
+ * Buffered records are not written, they may be half made. **/
+void recoverEmergency(struct recovery *r);
+
+/** Stops journaling. The journal is removed if discard is true,
+ * otherwise what is buffered is written. **/
+void recoverClose(struct recovery *r, bool discard);
+
+/** Replays the journal at path, if it was made against base.
+ * With apply NULL the records are only counted. Returns their
+ * number, -1 if there is no journal, -2 if it is of another
+ * version of the file. **/
+long long recoverReplay(const char *path, const struct recoverBase *base,
+    recoverApply apply, void *arg);
+
+#endif
@@ -6,7 +6,6 @@
 #include <stdlib.h>
 #include "dictionary.h"
 
-#define DICTIONARY "large.txt"
 #define INITIAL_SIZE 100
 
 /** info about detected misspelled words **/
@@ -69,73 +68,93 @@ struct misspelling getMisspellings(int index) {
 }
 
 /**
- * Given a row of text, fills in misspelling structures and 
- * appends them to an array. Uses the Trie created in the 
- * dictionary.c file to check each word in the text against 
- * a loaded dictionary.
- * @param text is the row of text to be checked.
+ * Given a row of text, finds the words that are checked:
+ * letters and apostrophes, skipping the words with digits
+ * and the ones longer than LENGTH.
+ * @param text is the row of text.
  * @param len is the length of text.
- * @param misspellings is the number of misspellings in the text.
- * @return the number of misspelled words in text.
+ * @param words is filled in with the start and end index
+ * of each word, the end is the index after it.
+ * @param max is the size of words.
+ * @return the number of words found.
  */ 
-int spellChecker(const char* text, int len, int misspellings) {
-    int index = 0, words = 0, cursor = 0;
-    char word[LENGTH+1];
-
-    /** Iterate over the given text **/
-    for (int i = 0; i < len; i++) {
+int spellWords(const char* text, int len, struct misspelling *words, int max) {
+    int index = 0, n = 0;
 
-        /** Find acceptable words that can be checked **/
-        if (isalpha(text[i]) || (text[i] == '\'' && index > 0)) {
-            /** Accept usual letters and apostrophes, 
-             * append to the word string **/
+    /** The end of the row ends the last word too **/
+    for (int i = 0; i <= len && n < max; i++) {
+        unsigned char c = i < len ? text[i] : ' ';
 
-            word[index] = text[i];
+        if (isalpha(c) || (c == '\'' && index > 0)) {
+            /** Accept usual letters and apostrophes **/
             index++;
 
             /** If the word exceeds the maximum 
              * (45 in English), skip it **/
             if (index > LENGTH) {
-                while (isalpha(text[i])) i++;
+                while (i < len && isalpha((unsigned char) text[i])) i++;
                 index = 0;
             }
 
-        } else if (isdigit(text[i])) {
+        } else if (isdigit(c)) {
             /** Skip words with digits **/
-            while (isalnum(text[i])) i++;
+            while (i < len && isalnum((unsigned char) text[i])) i++;
             index = 0;
 
         } else if (index > 0) {
-            /** For an acceptable word, check
-             * its spelling against the dictionary **/
-
-            word[index] = '\0';
-            words++;
-
-            if (!check(word)) {
-                /** If check returns false, the word is misspelled.
-                 * Hence, fill in the misspellings structure and 
-                 * put these in the allocated array **/
-
-                /** Reallocate space for the array if it is
-                 * exceeded. **/
-                if (misspellings-1==INITIAL_SIZE) {
-                    struct misspelling *miswords = realloc(miswords, 
-                    (sizeof(spell) * INITIAL_SIZE*2));
-                }
-
-                miswords[misspellings].start = (cursor-index);
-                miswords[misspellings].end = cursor;
-                misspellings++;
-            }
+            words[n].start = i - index;
+            words[n].end = i;
+            n++;
             index = 0;
         }
-        cursor++;
     }
-
-    /** Cleaning up **/
-    return misspellings;
+    return n;
 }
 
+/**
+ * Given a row of text, fills in misspelling structures and 
+ * appends them to an array. Uses the Trie created in the 
+ * dictionary.c file to check each word in the text against 
+ * a loaded dictionary.
+ * @param text is the row of text to be checked.
+ * @param len is the length of text.
+ * @param misspellings is the number of misspellings in the text.
+ * @return the number of misspelled words in text.
+ */ 
+int spellChecker(const char* text, int len, int misspellings) {
+    static struct misspelling *words;
+    static int wordcap, miscap = INITIAL_SIZE;
+    char word[LENGTH+1];
 
+    /** A word takes at least two characters of the row **/
+    if (len / 2 + 1 > wordcap) {
+        wordcap = len / 2 + 1;
+        words = realloc(words, sizeof(spell) * wordcap);
+        if (words == NULL) return misspellings;
+    }
+    int n = spellWords(text, len, words, wordcap);
+
+    for (int i = 0; i < n; i++) {
+        /** For an acceptable word, check
+         * its spelling against the dictionary **/
+        int wlen = words[i].end - words[i].start;
+        memcpy(word, text + words[i].start, wlen);
+        word[wlen] = '\0';
+        if (check(word)) continue;
+
+        /** If check returns false, the word is misspelled.
+         * Hence, put it in the allocated array, which is
+         * grown when it is full **/
+        if (misspellings == miscap) {
+            struct misspelling *grown = realloc(miswords,
+                sizeof(spell) * miscap * 2);
+            if (grown == NULL) break;
+            miswords = grown;
+            miscap *= 2;
+        }
+        miswords[misspellings++] = words[i];
+    }
 
+    /** Cleaning up **/
+    return misspellings;
+}
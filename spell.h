@@ -13,6 +13,11 @@ struct misspelling *miswords;
 /** Given an index, returns that misspelling structure **/
 struct misspelling getMisspellings(int index);
 
+/** Given a row of text and its length, fills in words with the
+ *  range of each word that is checked, at most max of them.
+ *  Returns their number **/
+int spellWords(const char* text, int len, struct misspelling *words, int max);
+
 /** Given a row of text, its length, fills in the miswords array
  *  and returns the number of misspellings **/
 int spellChecker(const char* text, int len, int misspellings);
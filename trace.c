@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "trace.h"
+
+/** A recorded stage, kept for the trace file **/
+typedef struct event {
+    int stage;
+    long long start;    /* traceNow() timestamp */
+    long long dur;
+} event;
+
+/** Events past this many are dropped **/
+#define TRACE_MAX_EVENTS (1 << 20)
+
+static struct histogram hist[TRACE_STAGES];
+static const char *names[TRACE_STAGES] = {
+    "readKey", "processKeypress", "scroll", "displayRows", "write", "latency"
+};
+
+static FILE *out;          /* Trace file, NULL if none */
+static event *events;
+static int nevents, capevents;
+static long long epoch;    /* Time of traceOpen */
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+long long traceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Finds the bucket of a value. Values below 2^TRACE_SUB_BITS
+ * have a bucket each, larger ones are split by their highest
+ * bit and the TRACE_SUB_BITS bits below it.
+ */
+static int bucketOf(long long v)
+{
+    if (v < (1 << TRACE_SUB_BITS))
+        return v < 0 ? 0 : v;
+    int e = 63 - __builtin_clzll(v);
+    int sub = (v >> (e - TRACE_SUB_BITS)) & ((1 << TRACE_SUB_BITS) - 1);
+    return ((e - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS) + sub;
+}
+
+/**
+ * Returns the largest value that falls in a bucket.
+ */
+static long long bucketTop(int b)
+{
+    if (b < (1 << TRACE_SUB_BITS))
+        return b;
+    int e = (b >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+    long long sub = b & ((1 << TRACE_SUB_BITS) - 1);
+    long long width = 1LL << (e - TRACE_SUB_BITS);
+    return (((1LL << TRACE_SUB_BITS) + sub) << (e - TRACE_SUB_BITS)) + width - 1;
+}
+
+/**
+ * Records the time a stage took. This is a single increment
+ * unless a trace file is open.
+ * @param stage is the traceStage.
+ * @param start is the traceNow() timestamp the stage began at.
+ */
+void traceEnd(int stage, long long start)
+{
+    long long dur = traceNow() - start;
+    struct histogram *h = &hist[stage];
+    h->count[bucketOf(dur)]++;
+    h->total++;
+    if (dur > h->max)
+        h->max = dur;
+
+    if (out == NULL || nevents == TRACE_MAX_EVENTS)
+        return;
+    if (nevents == capevents) {
+        int cap = capevents ? capevents * 2 : 4096;
+        event *e = realloc(events, sizeof(event) * cap);
+        if (e == NULL)
+            return;
+        events = e;
+        capevents = cap;
+    }
+    events[nevents].stage = stage;
+    events[nevents].start = start;
+    events[nevents].dur = dur;
+    nevents++;
+}
+
+/**
+ * Walks the histogram of a stage up to a share of its values.
+ * @param stage is the traceStage.
+ * @param p is the share, from 0 to 1.
+ * @return the value in nanoseconds, 0 if nothing was recorded.
+ */
+long long tracePercentile(int stage, double p)
+{
+    struct histogram *h = &hist[stage];
+    if (h->total == 0)
+        return 0;
+
+    unsigned long long rank = (unsigned long long) (p * h->total);
+    if (rank >= h->total)
+        rank = h->total - 1;
+    unsigned long long seen = 0;
+    for (int b = 0; b < TRACE_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen > rank) {
+            long long top = bucketTop(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+const struct histogram *traceHistogram(int stage)
+{
+    return &hist[stage];
+}
+
+const char *traceName(int stage)
+{
+    return names[stage];
+}
+
+/**
+ * Writes the kept events as complete ("X") events of the
+ * Chrome trace format, in microseconds since traceOpen.
+ */
+static void traceWrite(void)
+{
+    fprintf(out, "{\"traceEvents\":[\n");
+    for (int i = 0; i < nevents; i++) {
+        event *e = &events[i];
+        fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+            "\"ts\":%.3f,\"dur\":%.3f}%s\n", names[e->stage],
+            (e->start - epoch) / 1e3, e->dur / 1e3, i + 1 < nevents ? "," : "");
+    }
+    fprintf(out, "],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(out);
+    out = NULL;
+    free(events);
+}
+
+/**
+ * Opens the trace file, it is written when the editor exits.
+ * @param path is the file name.
+ * @return true if successful.
+ */
+bool traceOpen(const char *path)
+{
+    out = fopen(path, "w");
+    if (out == NULL)
+        return false;
+    epoch = traceNow();
+    atexit(traceWrite);
+    return true;
+}
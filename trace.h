@@ -0,0 +1,49 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdbool.h>
+
+/** Stages of handling a key and drawing a frame **/
+enum traceStage {
+    TRACE_READ,     /* readKey() */
+    TRACE_KEY,      /* processKeypress(), including readKey() */
+    TRACE_SCROLL,   /* scroll() */
+    TRACE_ROWS,     /* displayRows() */
+    TRACE_WRITE,    /* writing the frame to the terminal */
+    TRACE_LATENCY,  /* first key processed until its frame is written */
+    TRACE_STAGES
+};
+
+/** Histograms are log-linear: every power of two is split into
+ * 2^TRACE_SUB_BITS buckets, so values are kept to about 6%. **/
+#define TRACE_SUB_BITS 4
+#define TRACE_BUCKETS ((64 - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS)
+
+/** A latency histogram in nanoseconds **/
+struct histogram {
+    unsigned int count[TRACE_BUCKETS];
+    unsigned long long total;   /* Number of recorded values */
+    long long max;              /* Largest recorded value */
+};
+
+/** Returns a monotonic timestamp in nanoseconds **/
+long long traceNow(void);
+
+/** Records the time a stage took since start, a traceNow()
+ * timestamp. Also kept as an event if a trace file is open. **/
+void traceEnd(int stage, long long start);
+
+/** Returns the value below which a share p (0..1) of the
+ * recorded values of a stage fall, in nanoseconds. **/
+long long tracePercentile(int stage, double p);
+
+/** Returns the histogram of a stage **/
+const struct histogram *traceHistogram(int stage);
+
+/** Returns the name of a stage **/
+const char *traceName(int stage);
+
+/** Keeps every recorded event, and writes them to path as
+ * Chrome trace JSON at exit. Returns false if it can't be opened. **/
+bool traceOpen(const char *path);
+
+#endif